@@ -0,0 +1,145 @@
+#ifndef FLINCH_ALLOCSTATS_INCLUDE
+#define FLINCH_ALLOCSTATS_INCLUDE
+
+#include <mutex>
+#include <map>
+
+// allocation accounting, compiled in with INTERPRETER_ALLOC_STATS. counts allocations and bytes per AllocKind and per source line,
+// and keeps track of how many bytes of array storage are alive at once. everything goes through one lock,
+// so it's slow, but it's for finding out where memory goes, not for production builds.
+// bytes are estimates: what the vectors reserve, plus their headers. arrays that grow inside of builtins
+// only get their growth noticed when they're freed, so the peak can undercount scripts that grow arrays that way
+
+// where the interpreter is on this thread, so that allocations can be charged to a source line
+inline thread_local const int * alloc_lines = nullptr;
+inline thread_local size_t alloc_lines_n = 0;
+inline thread_local int alloc_ip = -1;
+
+struct AllocScope {
+    const int * prev_lines;
+    size_t prev_n;
+    int prev_ip;
+    AllocScope(const vector<int> & lines) : prev_lines(alloc_lines), prev_n(alloc_lines_n), prev_ip(alloc_ip)
+    {
+        alloc_lines = lines.data();
+        alloc_lines_n = lines.size();
+    }
+    ~AllocScope() { alloc_lines = prev_lines; alloc_lines_n = prev_n; alloc_ip = prev_ip; }
+};
+
+struct AllocCounts { uint64_t count = 0, bytes = 0; };
+
+struct AllocStats {
+    AllocCounts kinds[AllocKindCount];
+    std::map<int, AllocCounts> lines; // line 0 is anything that happened outside of the interpreter
+    int64_t live = 0; // bytes of array storage
+    int64_t peak = 0;
+};
+
+// never destroyed, since arrays can still be getting freed by other static destructors at exit
+struct AllocTracker {
+    std::mutex m;
+    AllocStats stats;
+};
+inline AllocTracker & alloc_tracker() { static auto t = new AllocTracker(); return *t; }
+
+inline void alloc_note(AllocKind kind, uint64_t bytes)
+{
+    int line = alloc_ip >= 0 && (size_t)alloc_ip < alloc_lines_n ? alloc_lines[alloc_ip] : 0;
+    auto & t = alloc_tracker();
+    std::lock_guard<std::mutex> lock(t.m);
+    auto & s = t.stats;
+    s.kinds[kind].count += 1;
+    s.kinds[kind].bytes += bytes;
+    s.lines[line].count += 1;
+    s.lines[line].bytes += bytes;
+}
+inline void alloc_live(int64_t bytes)
+{
+    auto & t = alloc_tracker();
+    std::lock_guard<std::mutex> lock(t.m);
+    auto & s = t.stats;
+    s.live += bytes;
+    s.peak = std::max(s.peak, s.live);
+}
+
+// for the host: a copy of the numbers so far
+inline AllocStats alloc_stats()
+{
+    auto & t = alloc_tracker();
+    std::lock_guard<std::mutex> lock(t.m);
+    return t.stats;
+}
+inline void alloc_stats_reset()
+{
+    auto & t = alloc_tracker();
+    std::lock_guard<std::mutex> lock(t.m);
+    auto live = t.stats.live;
+    t.stats = AllocStats{};
+    t.stats.live = live;
+    t.stats.peak = live;
+}
+
+inline void alloc_stats_report(FILE * f, size_t top = 20)
+{
+    auto s = alloc_stats();
+    const char * names[] = { "frame", "array", "reference", "copy", "clone", "concat", "growth" };
+    static_assert(sizeof(names) / sizeof(names[0]) == AllocKindCount);
+    fprintf(f, "\n%-24s %14s %16s\n", "allocation kind", "count", "bytes");
+    for (int k = 0; k < AllocKindCount; k++)
+        fprintf(f, "%-24s %14llu %16llu\n", names[k], (unsigned long long)s.kinds[k].count, (unsigned long long)s.kinds[k].bytes);
+
+    vector<std::pair<int, AllocCounts>> lines(s.lines.begin(), s.lines.end());
+    std::sort(lines.begin(), lines.end(), [](auto & a, auto & b) { return a.second.bytes > b.second.bytes; });
+    fprintf(f, "\n%-24s %14s %16s\n", "line", "count", "bytes");
+    for (size_t i = 0; i < lines.size() && i < top; i++)
+        fprintf(f, "%-24d %14llu %16llu\n", lines[i].first, (unsigned long long)lines[i].second.count, (unsigned long long)lines[i].second.bytes);
+    fprintf(f, "\narray storage: %lld bytes live, %lld bytes peak\n", (long long)s.live, (long long)s.peak);
+}
+
+// ArrayData deleter that remembers how many bytes the array was last accounted at
+template<typename T>
+struct AllocDeleter {
+    int64_t accounted;
+    void (*destroy)(T *) = [](T * v) { delete v; };
+    void operator()(T * v)
+    {
+        alloc_live(-accounted);
+        destroy(v);
+    }
+};
+template<typename T>
+inline int64_t alloc_array_bytes(const T & v) { return sizeof(T) + v.capacity() * sizeof(typename T::value_type); }
+
+template<typename T>
+shared_ptr<T> alloc_array_data(T && x, AllocKind kind)
+{
+    auto v = new T(std::move(x));
+    auto bytes = alloc_array_bytes(*v);
+    alloc_note(kind, bytes);
+    alloc_live(bytes);
+    return shared_ptr<T>(v, AllocDeleter<T>{bytes});
+}
+// same, for a subclass of T that has to be deleted as itself (e.g. InlineArrayStorage)
+template<typename T, typename D>
+shared_ptr<T> alloc_array_data_as(D * v, AllocKind kind)
+{
+    auto bytes = alloc_array_bytes<T>(*v);
+    alloc_note(kind, bytes);
+    alloc_live(bytes);
+    return shared_ptr<T>(v, AllocDeleter<T>{bytes, [](T * p) { delete static_cast<D *>(p); }});
+}
+// called after something that might have grown the array; counts any growth as the given kind
+template<typename T>
+void alloc_array_resized(shared_ptr<T> & items, AllocKind kind = AllocGrow)
+{
+    auto d = std::get_deleter<AllocDeleter<T>>(items);
+    if (!d) return;
+    auto bytes = alloc_array_bytes(*items);
+    if (bytes == d->accounted) return;
+    if (bytes > d->accounted) alloc_note(kind, bytes - d->accounted);
+    alloc_live(bytes - d->accounted);
+    d->accounted = bytes;
+}
+
+#endif // FLINCH_ALLOCSTATS_INCLUDE
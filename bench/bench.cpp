@@ -0,0 +1,231 @@
+
+// benchmark suite: times whole scripts (loading and running separately) and a set of per-opcode microbenchmarks, in-process.
+// results can be written as JSON and compared against an earlier run's JSON, failing if anything got slower than the threshold
+
+#include <cstdio>
+#include <string>
+#include <chrono>
+
+#include "../flinch.hpp"
+
+typedef std::chrono::steady_clock bench_clock;
+
+static const char * usage = R"(Usage: ./bench [options]
+  --root DIR         where examples/ and bench/ are (default ..)
+  --runs N           runs per benchmark; the fastest one counts (default 5)
+  --iters N          loop iterations per microbenchmark run (default 1000000)
+  --filter TEXT      only run benchmarks whose name contains TEXT
+  --no-workloads     skip the whole-script benchmarks
+  --no-micro         skip the microbenchmarks
+  --json FILE        write the results to FILE
+  --baseline FILE    compare against the results in FILE (written by --json)
+  --threshold X      how much slower than the baseline counts as a regression (default 0.10, i.e. 10%)
+)";
+
+static const char * workloads[][2] = {
+    { "pf", "examples/pf.fl" },
+    { "too_simple_2_shunting", "examples/too_simple_2_shunting.fl" },
+    { "lists", "examples/lists.fl" },
+    { "calls", "bench/workloads/calls.fl" },
+    { "arrays", "bench/workloads/arrays.fl" },
+    { "strings", "bench/workloads/strings.fl" },
+};
+
+// each one runs its body in a loop, inside of a function so that variables are locals.
+// "loop" is the empty loop, which gets subtracted from all of the others
+struct Micro { const char * name; const char * setup; const char * body; };
+static const Micro micros[] = {
+    { "loop", "", "" },
+    { "int_arith", "", "( x + i * 3 -> $x )" },
+    { "double_arith", "( 0.5 -> $x )", "( x * 1.0000001 + 0.5 -> $x )" },
+    { "compare_branch", "", "( i & 1 == 0 ) :even if_goto even:" },
+    { "local_assign", "", "i $x ->" },
+    { "global_read", "", "g $x ->" },
+    { "array_index", "[ 1 2 3 4 5 6 7 8 ] $a$ ->", "( a @ 3 -> $x )" },
+    { "array_write", "[ 1 2 3 4 5 6 7 8 ] $a$ ->", "( i -> $a @ 3 )" },
+    { "array_push_pop", "[ 1 2 3 4 5 6 7 8 ] $a$ ->", "$a i @++ $a @-- $x ->" },
+    { "array_literal", "", "[ i i i ] $x ->" },
+    { "array_concat", "[ 1 2 3 4 5 6 7 8 ] $a$ ->", "( a @@ a -> $x )" },
+    { "clone", "[ 1 2 3 4 5 6 7 8 ] $a$ ->", "( a :: -> $x )" },
+    { "string_copy", "", "\"hello, world\"* $x ->" },
+    { "call", "", "i .bench_id $x ->" },
+    { "builtin_call", "", "i !sqrt $x ->" },
+    { "map_set", "!map_new $m$ ->", "m ( i & 255 ) i !map_set" },
+    { "map_get", "!map_new $m$ -> m 7 1 !map_set", "m 7 !map_get $x ->" },
+};
+
+static string micro_script(const Micro & m, uint64_t iters)
+{
+    return string("( 0 -> $g$ )\n") +
+        "bench_id^ ^^\n" +
+        "bench^\n" +
+        "    ( 0 -> $x$ )\n" +
+        "    " + m.setup + "\n" +
+        "    ( -1 -> $i$ )\n" +
+        "    :loopend goto loopstart:\n" +
+        "        " + m.body + "\n" +
+        "    loopend: $i " + std::to_string(iters) + " :loopstart inc_goto_until\n" +
+        "^^\n" +
+        ".bench\n";
+}
+
+static void null_sink_write(void *, const char *, size_t) { }
+static size_t null_source_read(void *, char *, size_t) { return 0; }
+
+struct Result { string name; double load_ms, run_ms, ns; };
+
+static double ms_since(bench_clock::time_point start) { return std::chrono::duration<double, std::milli>(bench_clock::now() - start).count(); }
+
+static bool read_file(const string & filename, string & text)
+{
+    auto file = fopen(filename.data(), "rb");
+    if (!file) return false;
+    text.clear();
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), file))) text.append(buf, n);
+    fclose(file);
+    return true;
+}
+
+// fastest of `runs` loads and runs
+static void time_script(const string & text, int runs, double & load_ms, double & run_ms)
+{
+    load_ms = run_ms = 1e300;
+    for (int r = 0; r < runs; r++)
+    {
+        auto start = bench_clock::now();
+        auto p = load_program(text);
+        load_ms = std::min(load_ms, ms_since(start));
+        start = bench_clock::now();
+        interpret(p, {nullptr, null_sink_write}, {nullptr, null_source_read});
+        run_ms = std::min(run_ms, ms_since(start));
+    }
+}
+
+static void write_json(const string & filename, const vector<Result> & workload_results, const vector<Result> & micro_results)
+{
+    auto f = fopen(filename.data(), "wb");
+    if (!f) THROWSTR("Failed to open " + filename);
+    // one result per line, which is what read_baseline expects
+    fprintf(f, "{\n  \"workloads\": [");
+    for (size_t i = 0; i < workload_results.size(); i++)
+        fprintf(f, "%s\n    {\"name\": \"%s\", \"load_ms\": %.4f, \"run_ms\": %.4f}", i ? "," : "",
+            workload_results[i].name.data(), workload_results[i].load_ms, workload_results[i].run_ms);
+    fprintf(f, "\n  ],\n  \"micro\": [");
+    for (size_t i = 0; i < micro_results.size(); i++)
+        fprintf(f, "%s\n    {\"name\": \"%s\", \"ns_per_iter\": %.4f}", i ? "," : "", micro_results[i].name.data(), micro_results[i].ns);
+    fprintf(f, "\n  ]\n}\n");
+    fclose(f);
+}
+
+// name -> the number that gets compared (run_ms for workloads, ns_per_iter for microbenchmarks)
+static unordered_map<string, double> read_baseline(const string & filename)
+{
+    string text;
+    if (!read_file(filename, text)) THROWSTR("Failed to open " + filename);
+    unordered_map<string, double> ret;
+    size_t pos = 0;
+    while ((pos = text.find("{\"name\": \"", pos)) != string::npos)
+    {
+        pos += 10;
+        auto end = text.find('"', pos);
+        auto name = text.substr(pos, end - pos);
+        auto line_end = text.find('\n', end);
+        auto line = text.substr(end, line_end - end);
+        for (auto key : { "\"run_ms\": ", "\"ns_per_iter\": " })
+        {
+            auto k = line.find(key);
+            if (k != string::npos) ret[name] = std::stod(line.substr(k + strlen(key)));
+        }
+    }
+    return ret;
+}
+
+int main(int argc, char ** argv)
+{
+    string root = "..", filter, json, baseline;
+    int runs = 5;
+    uint64_t iters = 1000000;
+    double threshold = 0.10;
+    bool do_workloads = true, do_micro = true;
+
+    for (int a = 1; a < argc; a++)
+    {
+        string arg = argv[a];
+        auto value = [&]() { if (a + 1 >= argc) { fputs(usage, stdout); exit(1); } return string(argv[++a]); };
+        if (arg == "--root") root = value();
+        else if (arg == "--runs") runs = std::max(1, std::stoi(value()));
+        else if (arg == "--iters") iters = std::stoull(value());
+        else if (arg == "--filter") filter = value();
+        else if (arg == "--no-workloads") do_workloads = false;
+        else if (arg == "--no-micro") do_micro = false;
+        else if (arg == "--json") json = value();
+        else if (arg == "--baseline") baseline = value();
+        else if (arg == "--threshold") threshold = std::stod(value());
+        else return fputs(usage, stdout), arg == "--help" ? 0 : 1;
+    }
+    auto wanted = [&](const string & name) { return filter.empty() || name.find(filter) != string::npos; };
+
+    vector<Result> workload_results, micro_results;
+
+    if (do_workloads)
+    {
+        printf("%-24s %12s %12s\n", "workload", "load ms", "run ms");
+        for (auto & w : workloads)
+        {
+            if (!wanted(w[0])) continue;
+            string text;
+            if (!read_file(root + "/" + w[1], text))
+                return printf("Failed to open file %s/%s (see --root)\n", root.data(), w[1]), 1;
+            Result r{w[0], 0, 0, 0};
+            time_script(text, runs, r.load_ms, r.run_ms);
+            printf("%-24s %12.3f %12.3f\n", r.name.data(), r.load_ms, r.run_ms);
+            fflush(stdout);
+            workload_results.push_back(r);
+        }
+    }
+
+    if (do_micro)
+    {
+        double empty_ns = 0.0;
+        printf("\n%-24s %12s\n", "microbenchmark", "ns/iter");
+        for (auto & m : micros)
+        {
+            bool is_loop = string(m.name) == "loop";
+            if (!is_loop && !wanted(m.name)) continue;
+            double load_ms, run_ms;
+            time_script(micro_script(m, iters), runs, load_ms, run_ms);
+            double ns = run_ms * 1e6 / iters;
+            // the others are reported with the cost of the loop itself taken out
+            if (is_loop) empty_ns = ns;
+            else ns -= empty_ns;
+            if (!wanted(m.name)) continue;
+            printf("%-24s %12.3f\n", m.name, ns);
+            fflush(stdout);
+            micro_results.push_back({m.name, load_ms, run_ms, ns});
+        }
+    }
+
+    if (json.size()) write_json(json, workload_results, micro_results);
+
+    if (baseline.size())
+    {
+        auto old = read_baseline(baseline);
+        int regressions = 0;
+        auto check = [&](const string & name, double now, const char * unit) {
+            if (!old.count(name)) return;
+            double was = old[name];
+            // microbenchmarks that round to nothing can't meaningfully get x% slower
+            bool slower = now > was * (1.0 + threshold) && now - was > 0.05;
+            if (slower) regressions++;
+            printf("%s%-24s %10.3f -> %10.3f %s (%+.1f%%)\n", slower ? "REGRESSION " : "           ", name.data(), was, now, unit,
+                was != 0.0 ? 100.0 * (now - was) / was : 0.0);
+        };
+        printf("\ncompared to %s:\n", baseline.data());
+        for (auto & r : workload_results) check(r.name, r.run_ms, "ms");
+        for (auto & r : micro_results) check(r.name, r.ns, "ns");
+        if (regressions)
+            return printf("%d regression(s) over the %.0f%% threshold\n", regressions, threshold * 100.0), 2;
+    }
+}
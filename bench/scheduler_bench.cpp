@@ -0,0 +1,90 @@
+
+// load generator for scheduler.hpp: submits many instances of one script, at a fixed rate or as fast as possible,
+// then reports throughput and latency (time from submission to completion)
+
+#include <cstdio>
+#include <string>
+#include <chrono>
+
+#include "../scheduler.hpp"
+
+static const char * default_script = R"(
+    ( 0 -> $sum$ )
+    ( -1 -> $i$ )
+    :loopend goto loopstart:
+        ( i * i += $sum )
+    loopend: $i 10000 :loopstart inc_goto_until
+    sum !print
+)";
+
+static const char * usage = R"(Usage: ./scheduler_bench [options]
+  --jobs N           how many jobs to submit (default 10000)
+  --threads N        how many threads run them (default: hardware concurrency)
+  --rate X           jobs submitted per second, 0 for as fast as possible (default 0)
+  --slice N          slice budget, 0 for none (default 0)
+  --script FILE      run FILE instead of the built-in script
+)";
+
+void null_sink_write(void *, const char *, size_t) { }
+
+int main(int argc, char ** argv)
+{
+    size_t jobs = 10000;
+    size_t threads = std::thread::hardware_concurrency();
+    double rate = 0.0;
+    int64_t slice = 0;
+    string text = default_script;
+
+    for (int a = 1; a < argc; a++)
+    {
+        string arg = argv[a];
+        auto value = [&]() { if (a + 1 >= argc) { fputs(usage, stdout); exit(1); } return string(argv[++a]); };
+        if (arg == "--jobs") jobs = std::stoull(value());
+        else if (arg == "--threads") threads = std::stoull(value());
+        else if (arg == "--rate") rate = std::stod(value());
+        else if (arg == "--slice") slice = std::stoll(value());
+        else if (arg == "--script")
+        {
+            auto name = value();
+            auto file = fopen(name.data(), "rb");
+            if (!file)
+                return printf("Failed to open file %s\n", name.data()), 1;
+            text.clear();
+            char buf[4096];
+            size_t n;
+            while ((n = fread(buf, 1, sizeof(buf), file))) text.append(buf, n);
+            fclose(file);
+        }
+        else return fputs(usage, stdout), arg == "--help" ? 0 : 1;
+    }
+
+    auto p = load_program(text);
+
+    typedef std::chrono::steady_clock clock;
+    vector<double> latencies(jobs); // in microseconds
+    std::atomic<size_t> errors = 0;
+
+    auto start = clock::now();
+    {
+        Scheduler sched(p, threads, slice);
+        for (size_t j = 0; j < jobs; j++)
+        {
+            auto due = start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(rate > 0.0 ? j / rate : 0.0));
+            if (rate > 0.0) std::this_thread::sleep_until(due);
+            auto submitted = clock::now();
+            sched.submit({nullptr, null_sink_write}, stdin_source(), [&latencies, &errors, j, submitted](const string & error) {
+                latencies[j] = std::chrono::duration<double, std::micro>(clock::now() - submitted).count();
+                if (error.size()) errors++;
+            });
+        }
+        sched.wait();
+    }
+    double seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+    std::sort(latencies.begin(), latencies.end());
+    auto pct = [&](double q) { return latencies.size() ? latencies[std::min(latencies.size() - 1, (size_t)(q * latencies.size()))] : 0.0; };
+
+    printf("jobs: %zu (%zu failed), threads: %zu\n", jobs, (size_t)errors, threads);
+    printf("throughput: %.1f jobs/sec\n", jobs / seconds);
+    printf("latency: p50 %.1fus, p99 %.1fus, max %.1fus\n", pct(0.5), pct(0.99), latencies.size() ? latencies.back() : 0.0);
+}
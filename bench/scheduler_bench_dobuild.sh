@@ -0,0 +1,3 @@
+#!/usr/bin/env sh
+
+clang++ -g -ggdb -Wall -Wextra -pedantic -Wno-attributes -pthread scheduler_bench.cpp -O3 -frandom-seed=constant_seed -fuse-ld=lld -flto -mllvm -inline-threshold=10000 -o scheduler_bench
@@ -0,0 +1,117 @@
+
+// stress test for running separate interpreters on separate threads: loads one Program, then runs it on many
+// ProgramStates at once and checks that every run prints exactly what a run on its own does.
+// meant to be built with -fsanitize=thread (see thread_stress_dobuild.sh), which catches any state they still share
+
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <atomic>
+
+#include "../flinch.hpp"
+
+static const char * usage = R"(Usage: ./thread_stress [options]
+  --threads N        how many threads run interpreters at once (default: hardware concurrency, at least 4)
+  --runs N           how many times each thread runs the script (default 20)
+  --script FILE      run FILE instead of the built-in script, which touches every kind of per-state data
+)";
+
+// string literals (both kinds, and one that gets written to), arrays, maps, builtins that call back into the script,
+// coroutines, and a parallel_for, which every thread running at once makes share the worker pool
+static const char * default_script = R"(
+    double^ 2 * ^^
+    add^ + ^^
+    gen^
+        $n$ ->
+        loop:
+            n yield
+            ( n + 1 -> $n )
+        :loop goto
+    ^^
+    square^ $n$ -> ( n * n ) ^^
+
+    "hello" $s$ ->
+    ( 72 -> $s @ 0 )
+    s !printstr
+    "value"* $v$ ->
+    ( 33 -> $v @ 4 )
+    v !printstr
+
+    [ 5 3 9 1 7 ] $a$ ->
+    a !sort
+    a !print
+    a ^double !map !print
+    a 0 ^add !fold !print
+
+    !map_new $m$ ->
+    ( -1 -> $i$ )
+    :loopend goto loopstart:
+        m ( i % 7 ) i !map_set
+    loopend: $i 100 :loopstart inc_goto_until
+    m !map_len !print
+    m 3 !map_get !print
+
+    ^gen !coroutine $c$ ->
+    10 c resume !print
+    0 c resume !print
+
+    0 200 ^square !parallel_for !print
+)";
+
+void string_sink_write(void * userdata, const char * data, size_t len) { ((string *)userdata)->append(data, len); }
+size_t empty_source_read(void *, char *, size_t) { return 0; }
+
+string run_once(const Program & p)
+{
+    string out;
+    interpret(p, {&out, string_sink_write}, {nullptr, empty_source_read});
+    return out;
+}
+
+int main(int argc, char ** argv)
+{
+    size_t threads = std::max(4u, std::thread::hardware_concurrency());
+    size_t runs = 20;
+    string text = default_script;
+
+    for (int a = 1; a < argc; a++)
+    {
+        string arg = argv[a];
+        auto value = [&]() { if (a + 1 >= argc) { fputs(usage, stdout); exit(1); } return string(argv[++a]); };
+        if (arg == "--threads") threads = std::max(1ull, std::stoull(value()));
+        else if (arg == "--runs") runs = std::stoull(value());
+        else if (arg == "--script")
+        {
+            auto name = value();
+            auto file = fopen(name.data(), "rb");
+            if (!file)
+                return printf("Failed to open file %s\n", name.data()), 1;
+            text.clear();
+            char buf[4096];
+            size_t n;
+            while ((n = fread(buf, 1, sizeof(buf), file))) text.append(buf, n);
+            fclose(file);
+        }
+        else return fputs(usage, stdout), arg == "--help" ? 0 : 1;
+    }
+
+    auto p = load_program(text);
+    auto expected = run_once(p);
+
+    std::atomic<size_t> mismatches = 0, errors = 0;
+    vector<std::thread> pool;
+    for (size_t t = 0; t < threads; t++)
+    {
+        pool.emplace_back([&]() {
+            for (size_t r = 0; r < runs; r++)
+            {
+                try { if (run_once(p) != expected) mismatches++; }
+                catch (const exception & e) { if (errors++ == 0) fprintf(stderr, "%s\n", e.what()); }
+            }
+        });
+    }
+    for (auto & t : pool) t.join();
+
+    printf("threads: %zu, runs: %zu, mismatches: %zu, errors: %zu\n", threads, threads * runs, (size_t)mismatches, (size_t)errors);
+    return (mismatches || errors) ? 1 : 0;
+}
@@ -0,0 +1,3 @@
+#!/usr/bin/env sh
+
+clang++ -g -ggdb -Wall -Wextra -pedantic -Wno-attributes -pthread thread_stress.cpp -O1 -fsanitize=thread -o thread_stress
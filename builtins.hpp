@@ -1,36 +1,59 @@
 
 // built-in function definitions. customize however you want!
 
-void f_print_inner(DynamicType * val)
+#include "workpool.hpp"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+void f_print_inner(OutputBuffer & out, DynamicType * val)
 {
-    if (val->is_int())         printf("%zd", val->as_int());
-    else if (val->is_double()) printf("%.17g", val->as_double());
-    else if (val->is_func())   printf("<function>");
-    else if (val->is_label())  printf("<label>");
+    if (val->is_int())         out.put_int(val->as_int());
+    else if (val->is_double()) out.put_double(val->as_double());
+    else if (val->is_func())   out.write("<function>");
+    else if (val->is_label())  out.write("<label>");
+    else if (val->is_coro())   out.write("<coroutine>");
     else if (val->is_array())
     {
-        printf("[");
+        out.put('[');
         auto & list = *val->as_array().items();
         for (size_t i = 0; i < list.size(); i++)
         {
-            if (i != 0) printf(", ");
-            f_print_inner(&list[i]);
+            if (i != 0) out.write(", ", 2);
+            f_print_inner(out, &list[i]);
+        }
+        out.put(']');
+    }
+    else if (val->is_map())
+    {
+        out.put('{');
+        auto & m = *val->as_map().p;
+        for (size_t i = 0; i < m.size(); i++)
+        {
+            if (i != 0) out.write(", ", 2);
+            f_print_inner(out, &(*m.keys)[i]);
+            out.write(": ", 2);
+            f_print_inner(out, &(*m.values)[i]);
         }
-        printf("]");
+        out.put('}');
     }
     else if (val->is_ref())
     {
-        printf("&");
-        f_print_inner(val->as_ref().ref());
+        out.put('&');
+        f_print_inner(out, val->as_ref().ref());
     }
 }
-void f_print(vector<DynamicType> & stack)
+void f_print(ProgramState & s, vector<DynamicType> & stack)
 {
     DynamicType v = vec_pop_back(stack);
-    f_print_inner(&v);
-    printf("\n");
+    f_print_inner(s.out, &v);
+    s.out.put('\n');
 }
-void f_printstr(vector<DynamicType> & stack)
+void f_printstr(ProgramState & s, vector<DynamicType> & stack)
 {
     DynamicType v = vec_pop_back(stack);
     
@@ -45,23 +68,27 @@ void f_printstr(vector<DynamicType> & stack)
     for (size_t i = 0; i < list.size(); i++)
     {
         if (list[i].is_int())
-            printf("%c", (char)list[i].as_int());
+            s.out.put((char)list[i].as_int());
     }
-    puts("");
+    s.out.put('\n');
+}
+void f_flush(ProgramState & s, vector<DynamicType> &)
+{
+    s.out.flush();
 }
-void f_first(vector<DynamicType> & stack)
+void f_first(ProgramState &, vector<DynamicType> & stack)
 {
     DynamicType v = vec_pop_back(stack);
     Array * a = v.as_array_ptr_thru_ref();
     stack.push_back((*a->items())[0]);
 }
-void f_last(vector<DynamicType> & stack)
+void f_last(ProgramState &, vector<DynamicType> & stack)
 {
     DynamicType v = vec_pop_back(stack);
     Array * a = v.as_array_ptr_thru_ref();
     stack.push_back((*a->items()).back());
 }
-void f_dump(vector<DynamicType> & stack)
+void f_dump(ProgramState &, vector<DynamicType> & stack)
 {
     DynamicType v = vec_pop_back(stack);
     Array * a = v.as_array_ptr_thru_ref();
@@ -69,7 +96,7 @@ void f_dump(vector<DynamicType> & stack)
     for (auto x : *a->items())
         stack.push_back(x);
 }
-void f_sqrt(vector<DynamicType> & stack)
+void f_sqrt(ProgramState &, vector<DynamicType> & stack)
 {
     DynamicType val = vec_pop_back(stack);
     if (val.is_int())         stack.push_back(sqrt(val.as_int()));
@@ -77,15 +104,530 @@ void f_sqrt(vector<DynamicType> & stack)
     else THROWSTR("in sqrt: not a number");
 }
 
-//typedef void(*builtin_func)(vector<DynamicType> &);
+
+// input. files come in whole (mapped, not read), stdin comes in one line at a time
+// every byte becomes a 16-byte value, so a whole file costs 16x its size in memory; read big files with read_file_range
+string f_array_to_string(DynamicType & v)
+{
+    string ret;
+    for (auto & c : *v.as_array_ptr_thru_ref()->items()) ret += (char)c.as_into_int();
+    return ret;
+}
+void f_read_file(ProgramState &, vector<DynamicType> & stack)
+{
+    DynamicType v = vec_pop_back(stack);
+    auto fname = f_array_to_string(v);
+    auto ret = make_array_data();
+#ifndef _WIN32
+    int fd = open(fname.data(), O_RDONLY);
+    if (fd < 0) THROWSTR("in read_file: failed to open file " + fname);
+    struct stat info;
+    if (fstat(fd, &info) < 0) { close(fd); THROWSTR("in read_file: failed to read file " + fname); }
+    if (info.st_size > 0)
+    {
+        auto data = (const unsigned char *)mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) { close(fd); THROWSTR("in read_file: failed to read file " + fname); }
+        madvise((void *)data, info.st_size, MADV_SEQUENTIAL);
+        ret->reserve(info.st_size);
+        for (off_t i = 0; i < info.st_size; i++) ret->push_back((int64_t)data[i]);
+        munmap((void *)data, info.st_size);
+    }
+    close(fd);
+#else
+    auto file = fopen(fname.data(), "rb");
+    if (!file) THROWSTR("in read_file: failed to open file " + fname);
+    char buf[1 << 16];
+    while (size_t n = fread(buf, 1, sizeof(buf), file))
+        for (size_t i = 0; i < n; i++) ret->push_back((int64_t)(unsigned char)buf[i]);
+    fclose(file);
+#endif
+    stack.push_back(make_array(ret));
+}
+// name offset count !read_file_range: pushes up to count bytes starting at offset (fewer at the end of the file)
+void f_read_file_range(ProgramState &, vector<DynamicType> & stack)
+{
+    int64_t count = vec_pop_back(stack).as_into_int();
+    int64_t offset = vec_pop_back(stack).as_into_int();
+    DynamicType v = vec_pop_back(stack);
+    auto fname = f_array_to_string(v);
+    if (offset < 0 || count < 0) THROWSTR("in read_file_range: negative offset or count");
+    auto ret = make_array_data();
+    char buf[1 << 16];
+#ifndef _WIN32
+    int fd = open(fname.data(), O_RDONLY);
+    if (fd < 0) THROWSTR("in read_file_range: failed to open file " + fname);
+    while (count > 0)
+    {
+        auto n = pread(fd, buf, std::min<int64_t>(count, sizeof(buf)), offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) { close(fd); THROWSTR("in read_file_range: failed to read file " + fname); }
+        if (n == 0) break;
+        for (ssize_t i = 0; i < n; i++) ret->push_back((int64_t)(unsigned char)buf[i]);
+        offset += n;
+        count -= n;
+    }
+    close(fd);
+#else
+    auto file = fopen(fname.data(), "rb");
+    if (!file) THROWSTR("in read_file_range: failed to open file " + fname);
+    if (_fseeki64(file, offset, SEEK_SET) != 0) { fclose(file); THROWSTR("in read_file_range: failed to seek in file " + fname); }
+    while (count > 0)
+    {
+        size_t n = fread(buf, 1, std::min<int64_t>(count, sizeof(buf)), file);
+        if (n == 0) break;
+        for (size_t i = 0; i < n; i++) ret->push_back((int64_t)(unsigned char)buf[i]);
+        count -= n;
+    }
+    fclose(file);
+#endif
+    stack.push_back(make_array(ret));
+}
+// line !read_line: overwrites the given array with the next line of input (without the newline), reusing its storage
+// pushes 1 if a line was read and 0 at the end of input
+void f_read_line(ProgramState & s, vector<DynamicType> & stack)
+{
+    DynamicType v = vec_pop_back(stack);
+    Array * a = v.as_array_ptr_thru_ref();
+    a->dirtify();
+    auto & list = *a->items();
+    list.clear();
+    auto & in = s.in;
+    if (in.pos == in.len && !in.refill())
+        return stack.push_back(0);
+    while (1)
+    {
+        auto start = in.data.data() + in.pos;
+        auto end = (const char *)memchr(start, '\n', in.len - in.pos);
+        auto stop = end ? end : in.data.data() + in.len;
+        for (auto c = start; c < stop; c++) list.push_back((int64_t)(unsigned char)*c);
+        in.pos = stop - in.data.data() + !!end;
+        if (end || !in.refill()) break;
+    }
+    stack.push_back(1);
+}
+// pushes an array of every number found in a byte array, e.g. "12 -3,4.5" gives [12, -3, 4.5]
+void f_parse_numbers(ProgramState &, vector<DynamicType> & stack)
+{
+    DynamicType v = vec_pop_back(stack);
+    auto & list = *v.as_array_ptr_thru_ref()->items();
+    auto ret = make_array_data();
+    string text;
+    auto isnumchar = [](int64_t c) { return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E'; };
+    for (size_t i = 0; i < list.size(); )
+    {
+        if (!list[i].is_int() || !isnumchar(list[i].as_int())) { i++; continue; }
+        text.clear();
+        for (; i < list.size() && list[i].is_int() && isnumchar(list[i].as_int()); i++) text += (char)list[i].as_int();
+        const char * p = text.data();
+        auto last = text.data() + text.size();
+        while (p < last)
+        {
+            if (*p == '+') { p++; continue; }
+            int64_t n;
+            double d;
+            auto ri = from_chars(p, last, n);
+            auto rd = from_chars(p, last, d);
+            if (rd.ec == errc() && rd.ptr > ri.ptr) ret->push_back(d), p = rd.ptr;
+            else if (ri.ec == errc()) ret->push_back(n), p = ri.ptr;
+            else p++;
+        }
+    }
+    stack.push_back(make_array(ret));
+}
+
+// hash maps. like with arrays, maps can be given either directly or through a reference
+DynamicType f_pop_key(vector<DynamicType> & stack)
+{
+    DynamicType key = vec_pop_back(stack);
+    if (key.is_ref()) return *key.as_ref().ref();
+    return key;
+}
+void f_map_new(ProgramState &, vector<DynamicType> & stack) { stack.push_back(make_map()); }
+void f_map_set(ProgramState &, vector<DynamicType> & stack)
+{
+    DynamicType val = vec_pop_back(stack);
+    DynamicType key = f_pop_key(stack);
+    DynamicType v = vec_pop_back(stack);
+    auto & m = *v.as_map_ptr_thru_ref()->p;
+    auto idx = m.insert(key); // before touching values, which inserting can replace
+    (*m.values)[idx] = std::move(val);
+}
+void f_map_get(ProgramState &, vector<DynamicType> & stack)
+{
+    DynamicType key = f_pop_key(stack);
+    DynamicType v = vec_pop_back(stack);
+    auto & m = *v.as_map_ptr_thru_ref()->p;
+    auto i = m.find(key);
+    if (i < 0) THROWSTR("in map_get: key not found");
+    stack.push_back((*m.values)[i]);
+}
+// map key !map_ref: reference to the key's value (inserting 0 first if needed), for use with -> += etc
+void f_map_ref(ProgramState &, vector<DynamicType> & stack)
+{
+    DynamicType key = f_pop_key(stack);
+    DynamicType v = vec_pop_back(stack);
+    auto & m = *v.as_map_ptr_thru_ref()->p;
+    stack.push_back(make_ref(m.values, m.insert(key)));
+}
+void f_map_has(ProgramState &, vector<DynamicType> & stack)
+{
+    DynamicType key = f_pop_key(stack);
+    DynamicType v = vec_pop_back(stack);
+    stack.push_back((int64_t)(v.as_map_ptr_thru_ref()->p->find(key) >= 0));
+}
+void f_map_del(ProgramState &, vector<DynamicType> & stack)
+{
+    DynamicType key = f_pop_key(stack);
+    DynamicType v = vec_pop_back(stack);
+    v.as_map_ptr_thru_ref()->p->erase(key);
+}
+void f_map_len(ProgramState &, vector<DynamicType> & stack)
+{
+    DynamicType v = vec_pop_back(stack);
+    stack.push_back((int64_t)v.as_map_ptr_thru_ref()->p->size());
+}
+// keys and values come out in matching order, so they can be iterated over side by side
+void f_map_keys(ProgramState &, vector<DynamicType> & stack)
+{
+    DynamicType v = vec_pop_back(stack);
+    auto & m = *v.as_map_ptr_thru_ref()->p;
+    auto ret = make_array_data();
+    for (auto & k : *m.keys) ret->push_back(k.clone(false));
+    stack.push_back(make_array(ret));
+}
+void f_map_values(ProgramState &, vector<DynamicType> & stack)
+{
+    DynamicType v = vec_pop_back(stack);
+    stack.push_back(make_array(make_array_data(*v.as_map_ptr_thru_ref()->p->values)));
+}
+
+// functionals. these call back into the interpreter for each item, reusing one frame for every call
+// they take a function or a fake closure (an array ending in a function); a fake closure's other items are pushed after the item
+struct FCallable {
+    Func f;
+    DynamicType bound;
+};
+FCallable f_pop_callable(vector<DynamicType> & stack)
+{
+    DynamicType v = vec_pop_back(stack);
+    if (v.is_func()) return {v.as_func(), 0};
+    auto & list = *v.as_array_ptr_thru_ref()->items();
+    if (!list.size() || !list.back().is_func()) THROWSTR("Expected a function or an array ending in a function");
+    return {list.back().as_func(), v};
+}
+void f_invoke(ProgramState & s, FCallable & c, ArrayData & frame)
+{
+    if (c.bound.is_array() || c.bound.is_ref())
+    {
+        auto & list = *c.bound.as_array_ptr_thru_ref()->items();
+        for (size_t i = 0; i + 1 < list.size(); i++) s.evalstack.push_back(list[i]);
+    }
+    call_func(s, c.f, &frame);
+}
+DynamicType f_take_result(vector<DynamicType> & stack, size_t base, const char * name)
+{
+    if (stack.size() != base + 1) THROWSTR(string("in ") + name + ": function must return exactly one value");
+    return vec_pop_back(stack);
+}
+// array f !map: new array of the function's return value for each item
+void f_map(ProgramState & s, vector<DynamicType> & stack)
+{
+    auto c = f_pop_callable(stack);
+    Array a = *vec_pop_back(stack).as_array_ptr_thru_ref(); // holding a handle, not a pointer, in case the function reassigns things
+    auto ret = make_array_data();
+    ret->reserve(a.items()->size());
+    ArrayData frame;
+    auto base = stack.size();
+    for (size_t i = 0; i < a.items()->size(); i++)
+    {
+        stack.push_back((*a.items())[i]);
+        f_invoke(s, c, frame);
+        ret->push_back(f_take_result(stack, base, "map"));
+    }
+    stack.push_back(make_array(ret));
+}
+// array f !filter: new array of the items that the function returned something truthy for
+void f_filter(ProgramState & s, vector<DynamicType> & stack)
+{
+    auto c = f_pop_callable(stack);
+    Array a = *vec_pop_back(stack).as_array_ptr_thru_ref();
+    auto ret = make_array_data();
+    ArrayData frame;
+    auto base = stack.size();
+    for (size_t i = 0; i < a.items()->size(); i++)
+    {
+        auto item = (*a.items())[i];
+        stack.push_back(item);
+        f_invoke(s, c, frame);
+        if (f_take_result(stack, base, "filter")) ret->push_back(std::move(item));
+    }
+    stack.push_back(make_array(ret));
+}
+// array init f !fold: calls the function with the accumulator and then the item on the stack, and keeps its return value as the new accumulator
+void f_fold(ProgramState & s, vector<DynamicType> & stack)
+{
+    auto c = f_pop_callable(stack);
+    DynamicType acc = vec_pop_back(stack);
+    Array a = *vec_pop_back(stack).as_array_ptr_thru_ref();
+    ArrayData frame;
+    auto base = stack.size();
+    for (size_t i = 0; i < a.items()->size(); i++)
+    {
+        stack.push_back(std::move(acc));
+        stack.push_back((*a.items())[i]);
+        f_invoke(s, c, frame);
+        acc = f_take_result(stack, base, "fold");
+    }
+    stack.push_back(std::move(acc));
+}
+// array f !each: calls the function on each item, throwing away whatever it returns
+void f_each(ProgramState & s, vector<DynamicType> & stack)
+{
+    auto c = f_pop_callable(stack);
+    Array a = *vec_pop_back(stack).as_array_ptr_thru_ref();
+    ArrayData frame;
+    auto base = stack.size();
+    for (size_t i = 0; i < a.items()->size(); i++)
+    {
+        stack.push_back((*a.items())[i]);
+        f_invoke(s, c, frame);
+        if (stack.size() < base) THROWSTR("in each: function consumed too many values");
+        stack.erase(stack.begin() + base, stack.end());
+    }
+}
+
+// start end f !parallel_for: calls f with each index from start up to (not including) end, spread over a thread pool
+// each thread gets its own state (eval stack, frames), but they all share the caller's globals and the closure's bound values.
+// writing to different indexes of shared arrays is fine; resizing them isn't, and throws
+// whatever f returns (if anything) gets added together and pushed at the end
+void f_parallel_for(ProgramState & s, vector<DynamicType> & stack)
+{
+    auto c = f_pop_callable(stack);
+    int64_t end = vec_pop_back(stack).as_into_int();
+    int64_t start = vec_pop_back(stack).as_into_int();
+    if (s.in_parallel) THROWSTR("in parallel_for: can't be nested");
+    
+    struct Worker {
+        std::thread::id thread;
+        unique_ptr<ProgramState> state;
+        ArrayData frame;
+        DynamicType sum;
+    };
+    vector<unique_ptr<Worker>> workers;
+    std::mutex workers_m;
+    auto get_worker = [&]() -> Worker & {
+        std::lock_guard<std::mutex> lock(workers_m);
+        for (auto & w : workers) { if (w->thread == std::this_thread::get_id()) return *w; }
+        auto w = make_unique<Worker>();
+        w->thread = std::this_thread::get_id();
+        w->state = make_unique<ProgramState>(s.programdata, s.out.sink, s.in.source);
+        w->state->globals = s.globals;
+        w->state->globals_raw = s.globals_raw;
+        w->state->in_parallel = true;
+        workers.push_back(std::move(w));
+        return *workers.back();
+    };
+    
+    auto & pool = default_workpool();
+    int64_t chunk = std::max((int64_t)1, (end - start) / (int64_t)(pool.size() * 4));
+    vector<std::function<void()>> tasks;
+    for (int64_t lo = start; lo < end; lo += chunk)
+    {
+        tasks.push_back([&, lo]() {
+            auto & w = get_worker();
+            auto & ws = *w.state;
+            auto base = ws.evalstack.size();
+            for (int64_t i = lo; i < std::min(end, lo + chunk); i++)
+            {
+                ws.evalstack.push_back(i);
+                f_invoke(ws, c, w.frame);
+                if (ws.evalstack.size() == base + 1) w.sum = w.sum + vec_pop_back(ws.evalstack);
+                else if (ws.evalstack.size() != base) THROWSTR("in parallel_for: function must return one value or nothing");
+            }
+        });
+    }
+    
+    s.out.flush();
+    for (size_t i = 0; i < s.globals->size(); i++) set_shared((*s.globals)[i], true);
+    set_shared(c.bound, true);
+    try { pool.run_all(tasks); }
+    catch (...)
+    {
+        workers.clear();
+        for (size_t i = 0; i < s.globals->size(); i++) set_shared((*s.globals)[i], false);
+        set_shared(c.bound, false);
+        throw;
+    }
+    
+    DynamicType sum = 0;
+    for (auto & w : workers) sum = sum + w->sum;
+    #ifdef INTERPRETER_PROFILE
+    for (auto & w : workers) s.profile.merge(w->state->profile);
+    #endif
+    workers.clear(); // flushes their output, and drops their references to shared things before unsharing them
+    for (size_t i = 0; i < s.globals->size(); i++) set_shared((*s.globals)[i], false);
+    set_shared(c.bound, false);
+    stack.push_back(sum);
+}
+
+// coroutines. f !coroutine makes a new one, which starts running f on its first resume
+void f_coroutine(ProgramState & s, vector<DynamicType> & stack)
+{
+    stack.push_back(make_coro(s.programdata, vec_pop_back(stack).as_func()));
+}
+// coro !coro_done: whether its function has returned, i.e. whether resuming it again is an error
+void f_coro_done(ProgramState &, vector<DynamicType> & stack)
+{
+    DynamicType v = vec_pop_back(stack);
+    stack.push_back((int64_t)v.as_coro().p->done);
+}
+
+// prints the profile so far to stderr, if built with INTERPRETER_PROFILE; does nothing otherwise
+void f_profile_report(ProgramState & s, vector<DynamicType> &)
+{
+    #ifdef INTERPRETER_PROFILE
+    s.out.flush();
+    s.profile.report(s.programdata, stderr);
+    #else
+    (void)s;
+    #endif
+}
+
+// sorting, searching and heaps. these work on arrays of numbers (key < 0) or on arrays of arrays,
+// compared by the element at index `key` of each inner array
+DynamicType & sort_key(DynamicType & v, int64_t key)
+{
+    if (key < 0) return v;
+    return v.as_array_ptr_thru_ref()->items()->at(key);
+}
+// NaN doesn't compare less or greater than anything, which breaks std::sort's strict weak ordering (undefined behavior,
+// which can run off the end of the array), so it's ordered explicitly: after every other number, and equal to itself
+inline bool is_nan(DynamicType & v) { return v.is_double() && std::isnan(v.as_double()); }
+bool value_less(DynamicType & a, DynamicType & b)
+{
+    bool an = is_nan(a), bn = is_nan(b);
+    if (an || bn) return !an && bn;
+    return a < b;
+}
+bool sort_less(DynamicType & a, DynamicType & b, int64_t key) { return value_less(sort_key(a, key), sort_key(b, key)); }
+
+void f_sort_inner(vector<DynamicType> & stack, int64_t key)
+{
+    DynamicType v = vec_pop_back(stack);
+    v.as_array_ptr_thru_ref()->own();
+    auto & list = *v.as_array_ptr_thru_ref()->items();
+    std::sort(list.begin(), list.end(), [&](DynamicType & a, DynamicType & b) { return sort_less(a, b, key); });
+}
+void f_sort(ProgramState &, vector<DynamicType> & stack) { f_sort_inner(stack, -1); }
+void f_sort_by(ProgramState &, vector<DynamicType> & stack)
+{
+    int64_t key = vec_pop_back(stack).as_into_int();
+    f_sort_inner(stack, key);
+}
+// pushes the index of the first element that isn't less than the needle (i.e. lower bound)
+void f_bsearch_inner(vector<DynamicType> & stack, DynamicType & v, DynamicType & needle, int64_t key)
+{
+    auto & list = *v.as_array_ptr_thru_ref()->items();
+    size_t lo = 0, hi = list.size();
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (value_less(sort_key(list[mid], key), needle)) lo = mid + 1;
+        else hi = mid;
+    }
+    stack.push_back((int64_t)lo);
+}
+void f_bsearch(ProgramState &, vector<DynamicType> & stack)
+{
+    DynamicType needle = vec_pop_back(stack);
+    DynamicType v = vec_pop_back(stack);
+    f_bsearch_inner(stack, v, needle, -1);
+}
+void f_bsearch_by(ProgramState &, vector<DynamicType> & stack)
+{
+    DynamicType needle = vec_pop_back(stack);
+    int64_t key = vec_pop_back(stack).as_into_int();
+    DynamicType v = vec_pop_back(stack);
+    f_bsearch_inner(stack, v, needle, key);
+}
+// binary min-heap stored directly in an array: heap key value !heap_push, heap key !heap_pop
+void f_heap_push(ProgramState &, vector<DynamicType> & stack)
+{
+    DynamicType val = vec_pop_back(stack);
+    int64_t key = vec_pop_back(stack).as_into_int();
+    DynamicType v = vec_pop_back(stack);
+    Array * a = v.as_array_ptr_thru_ref();
+    a->dirtify();
+    auto & list = *a->items();
+    list.push_back(std::move(val));
+    size_t i = list.size() - 1;
+    while (i > 0)
+    {
+        size_t parent = (i - 1) / 2;
+        if (!sort_less(list[i], list[parent], key)) break;
+        std::swap(list[i], list[parent]);
+        i = parent;
+    }
+}
+void f_heap_pop(ProgramState &, vector<DynamicType> & stack)
+{
+    int64_t key = vec_pop_back(stack).as_into_int();
+    DynamicType v = vec_pop_back(stack);
+    Array * a = v.as_array_ptr_thru_ref();
+    a->dirtify();
+    auto & list = *a->items();
+    if (!list.size()) THROWSTR("tried to pop from empty heap");
+    std::swap(list.front(), list.back());
+    stack.push_back(vec_pop_back(list));
+    size_t i = 0;
+    while (1)
+    {
+        size_t l = i * 2 + 1, r = l + 1, m = i;
+        if (l < list.size() && sort_less(list[l], list[m], key)) m = l;
+        if (r < list.size() && sort_less(list[r], list[m], key)) m = r;
+        if (m == i) break;
+        std::swap(list[i], list[m]);
+        i = m;
+    }
+}
+
+//typedef void(*builtin_func)(ProgramState &, vector<DynamicType> &);
 //const static builtin_func builtins[] = {
-static void(* const builtins [])(vector<DynamicType> &) = {
+static void(* const builtins [])(ProgramState &, vector<DynamicType> &) = {
     f_print,
     f_printstr,
     f_first,
     f_last,
     f_dump,
     f_sqrt,
+    f_sort,
+    f_sort_by,
+    f_bsearch,
+    f_bsearch_by,
+    f_heap_push,
+    f_heap_pop,
+    f_flush,
+    f_read_file,
+    f_read_line,
+    f_parse_numbers,
+    f_map_new,
+    f_map_set,
+    f_map_get,
+    f_map_ref,
+    f_map_has,
+    f_map_del,
+    f_map_len,
+    f_map_keys,
+    f_map_values,
+    f_map,
+    f_filter,
+    f_fold,
+    f_each,
+    f_parallel_for,
+    f_coroutine,
+    f_coro_done,
+    f_profile_report,
+    f_read_file_range,
 };
 static inline int builtins_lookup(const string & s)
 {
@@ -101,6 +643,62 @@ static inline int builtins_lookup(const string & s)
         return 4;
     else if (s == std::string("sqrt"))
         return 5;
+    else if (s == std::string("sort"))
+        return 6;
+    else if (s == std::string("sort_by"))
+        return 7;
+    else if (s == std::string("bsearch"))
+        return 8;
+    else if (s == std::string("bsearch_by"))
+        return 9;
+    else if (s == std::string("heap_push"))
+        return 10;
+    else if (s == std::string("heap_pop"))
+        return 11;
+    else if (s == std::string("flush"))
+        return 12;
+    else if (s == std::string("read_file"))
+        return 13;
+    else if (s == std::string("read_line"))
+        return 14;
+    else if (s == std::string("parse_numbers"))
+        return 15;
+    else if (s == std::string("map_new"))
+        return 16;
+    else if (s == std::string("map_set"))
+        return 17;
+    else if (s == std::string("map_get"))
+        return 18;
+    else if (s == std::string("map_ref"))
+        return 19;
+    else if (s == std::string("map_has"))
+        return 20;
+    else if (s == std::string("map_del"))
+        return 21;
+    else if (s == std::string("map_len"))
+        return 22;
+    else if (s == std::string("map_keys"))
+        return 23;
+    else if (s == std::string("map_values"))
+        return 24;
+    else if (s == std::string("map"))
+        return 25;
+    else if (s == std::string("filter"))
+        return 26;
+    else if (s == std::string("fold"))
+        return 27;
+    else if (s == std::string("each"))
+        return 28;
+    else if (s == std::string("parallel_for"))
+        return 29;
+    else if (s == std::string("coroutine"))
+        return 30;
+    else if (s == std::string("coro_done"))
+        return 31;
+    else if (s == std::string("profile_report"))
+        return 32;
+    else if (s == std::string("read_file_range"))
+        return 33;
     else
         THROWSTR("Unknown built-in function: " + s);
 };
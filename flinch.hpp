@@ -15,11 +15,17 @@
 #include <cstring>
 #include <memory>
 #include <algorithm>
+#include <charconv>
 
 #include <unordered_map>
 #include <unordered_set>
 #include <initializer_list>
 
+#ifndef _WIN32
+#include <unistd.h>
+#include <cerrno>
+#endif
+
 #ifndef NOINLINE
 #define NOINLINE __attribute__((noinline))
 #endif
@@ -30,20 +36,28 @@ template <typename T> [[noreturn]] void THROWSTR(T X) { throw std::runtime_error
 //template <typename T> [[noreturn]] void THROWSTR(T X) { throw X; }
 //template <typename T> [[noreturn]] void THROWSTR(T) { throw; }
 
+// an error tagged with the line it came from. if it passes up through a builtin that called back into the script,
+// the outer interpreter retags it with its own line instead of wrapping it again
+struct ScriptError : std::runtime_error {
+    std::string message;
+    ScriptError(const std::string & message, const std::string & what) : std::runtime_error(what), message(message) {}
+};
 template <typename T>
 [[noreturn]] void rethrow(int line, int i, T & e)
 {
-    THROWSTR("Error on line " + std::to_string(line) + ": " + e.what() + " (token " + std::to_string(i) + ")");
+    auto inner = dynamic_cast<const ScriptError *>(&e);
+    std::string message = inner ? inner->message : e.what();
+    throw ScriptError(message, "Error on line " + std::to_string(line) + ": " + message + " (token " + std::to_string(i) + ")");
 }
 
-template <typename T> T & vec_at_back(std::vector<T> & v)
+template <typename V> typename V::value_type & vec_at_back(V & v)
 {
     if (!v.size()) THROWSTR("tried to access empty buffer");
     return v.back();
 }
-template <typename T> T vec_pop_back(std::vector<T> & v)
+template <typename V> typename V::value_type vec_pop_back(V & v)
 {
-    T ret = std::move(vec_at_back(v));
+    typename V::value_type ret = std::move(vec_at_back(v));
     v.pop_back();
     return ret;
 }
@@ -65,14 +79,15 @@ PFX(Add),PFX(Sub),PFX(Mul),PFX(Div),PFX(Mod),\
     PFX(AddDubInline),PFX(SubDubInline),PFX(MulDubInline),PFX(DivDubInline),PFX(ModDubInline),\
 PFX(Neg),PFX(BitNot),PFX(And),PFX(Or),PFX(Xor),PFX(Shl),PFX(Shr),PFX(BoolNot),PFX(BoolAnd),PFX(BoolOr),\
 PFX(ScopeOpen),PFX(ScopeClose),PFX(ArrayBuild),PFX(ArrayEmptyLit),PFX(Clone),PFX(CloneDeep),PFX(Punt),PFX(PuntN),\
-PFX(ArrayIndex),PFX(ArrayLen),PFX(ArrayLenMinusOne),PFX(ArrayPushIn),PFX(ArrayPopOut),PFX(ArrayPushBack),PFX(ArrayPopBack),PFX(ArrayConcat),\
+PFX(ArrayIndex),PFX(ArrayLen),PFX(ArrayLenMinusOne),PFX(ArrayPushIn),PFX(ArrayPopOut),PFX(ArrayPushBack),PFX(ArrayPopBack),PFX(ArrayConcat),PFX(ArraySlice),PFX(ArrayIndexConst),PFX(ArrayIndexUnchecked),\
 PFX(StringLiteral),PFX(StringLitReference),\
 PFX(FuncDec),PFX(FuncLookup),PFX(FuncCall),PFX(FuncEnd),PFX(LabelDec),PFX(LabelLookup),\
 PFX(Goto),PFX(GotoLabel),PFX(IfGoto),PFX(IfGotoLabel),\
     PFX(IfGotoLabelEQ),PFX(IfGotoLabelNE),PFX(IfGotoLabelLE),PFX(IfGotoLabelGE),PFX(IfGotoLabelLT),PFX(IfGotoLabelGT),\
     PFX(        CmpEQ),PFX(        CmpNE),PFX(        CmpLE),PFX(        CmpGE),PFX(        CmpLT),PFX(        CmpGT),\
-PFX(ForLoop),PFX(ForLoopLabel),PFX(ForLoopLocal),\
-PFX(Call),PFX(BuiltinCall),PFX(Return)
+PFX(ForLoop),PFX(ForLoopLabel),PFX(ForLoopLocal),PFX(ForLoopKernel),PFX(ForLoopLocalLen),PFX(ForLoopLocalVar),\
+PFX(Call),PFX(BuiltinCall),PFX(Return),\
+PFX(Yield),PFX(Resume),PFX(CoroEnd)
 
 // token kind
 #define PFX(X) X
@@ -82,8 +97,8 @@ enum TKind : iword_t {
 };
 #undef PFX
 
-#define PFX(X) { (X) , (#X) }
-unordered_map<TKind, const char *> tnames = { TOKEN_TABLE };
+#define PFX(X) #X
+const char * const tnames[] = { TOKEN_TABLE };
 #undef PFX
 
 //struct Token { TKind kind; iword_t n, extra_1, extra_2; };
@@ -94,23 +109,224 @@ Token make_token(TKind kind, iword_t n) { return {kind, n, 0, 0}; }
 
 struct DynamicType;
 
-typedef shared_ptr<vector<DynamicType>> ArrayData;
+// what arrays keep their items in: like a vector, except that it can also keep spare room at the front, so that
+// inserting and removing at the front (e.g. using an array as a queue) is amortized O(1) instead of shifting everything over.
+// the room at the front only gets made once something inserts there. every slot of the allocation holds a constructed T,
+// and slots outside of [b, e) are kept default-constructed, so that they don't hold on to anything.
+// a template only so that it can be declared before DynamicType is complete, like vector can
+template<typename T>
+struct ArrayStorage {
+    T * store = nullptr;
+    size_t cap = 0;
+    T * b = nullptr;
+    T * e = nullptr;
+    // set for a view: [b, e) is borrowed from base, which it keeps alive. views own no slots and are never written to,
+    // because the arrays holding them are marked cow (see array_slice)
+    shared_ptr<ArrayStorage> base;
+    // set when the first slots were allocated along with this (see InlineArrayStorage). those don't get delete[]d
+    T * local = nullptr;
+    
+    typedef T value_type;
+    typedef T * iterator;
+    typedef const T * const_iterator;
+    
+    ArrayStorage() { }
+    ArrayStorage(size_t n, const T & x) { reserve(n); for (size_t i = 0; i < n; i++) *e++ = x; }
+    ArrayStorage(vector<T> && x) { reserve(x.size()); for (auto & item : x) *e++ = std::move(item); }
+    ArrayStorage(const vector<T> & x) { reserve(x.size()); for (auto & item : x) *e++ = item; }
+    ArrayStorage(const ArrayStorage & x) { reserve(x.size()); for (auto & item : x) *e++ = item; }
+    // inline slots can't change hands, so those get moved item by item
+    ArrayStorage(ArrayStorage && x) noexcept { if (x.local) *this = ArrayStorage(x); else swap(x); }
+    ArrayStorage & operator=(ArrayStorage x) noexcept
+    {
+        if (!local) swap(x);
+        else { clear(); reserve(x.size()); for (auto & item : x) *e++ = std::move(item); }
+        return *this;
+    }
+    ~ArrayStorage() { if (store != local) delete[] store; }
+    void swap(ArrayStorage & x) noexcept { std::swap(store, x.store); std::swap(cap, x.cap); std::swap(b, x.b); std::swap(e, x.e); base.swap(x.base); }
+    
+    size_t size() const { return e - b; }
+    bool empty() const { return e == b; }
+    size_t capacity() const { return base ? 0 : cap - (b - store); }
+    T * data() { return b; }
+    iterator begin() { return b; }
+    iterator end() { return e; }
+    const_iterator begin() const { return b; }
+    const_iterator end() const { return e; }
+    T & operator[](size_t i) { return b[i]; }
+    T & at(size_t i)
+    {
+        if (i >= size()) throw std::out_of_range("index " + std::to_string(i) + " is out of bounds for an array of size " + std::to_string(size()));
+        return b[i];
+    }
+    T & front() { return *b; }
+    T & back() { return e[-1]; }
+    
+    // moves the items into a new allocation with room for n of them, plus `front` spare slots before them
+    void realloc(size_t n, size_t front = 0)
+    {
+        auto s = new T[front + n];
+        auto nb = s + front, ne = nb;
+        for (auto p = b; p != e; p++) *ne++ = std::move(*p);
+        if (store != local) delete[] store;
+        else for (auto p = b; p != e; p++) *p = T();
+        store = s;
+        cap = front + n;
+        b = nb;
+        e = ne;
+    }
+    void reserve(size_t n) { if (n > capacity()) realloc(n); }
+    // makes room for one more at the back: by moving the items down into the spare room at the front, if that's
+    // at least as much as the items themselves (so it doesn't happen too often), or else by reallocating
+    void grow_back()
+    {
+        if (e != store + cap) return;
+        if (b != store && (size_t)(b - store) >= size())
+        {
+            auto nb = store;
+            for (auto p = b; p != e; p++) *nb++ = std::move(*p);
+            for (auto p = nb; p != e; p++) *p = T();
+            e = nb;
+            b = store;
+        }
+        else realloc(std::max((size_t)4, size() * 2));
+    }
+    void resize(size_t n)
+    {
+        if (n < size()) { for (auto p = b + n; p != e; p++) *p = T(); e = b + n; return; }
+        reserve(n);
+        e = b + n;
+    }
+    void clear() { for (auto p = b; p != e; p++) *p = T(); b = e = store; }
+    void push_back(const T & x) { if (e == store + cap) { T copy = x; grow_back(); *e++ = std::move(copy); } else *e++ = x; }
+    void push_back(T && x) { grow_back(); *e++ = std::move(x); }
+    void pop_back() { *--e = T(); if (e == b) b = e = store; }
+    
+    iterator insert(const_iterator pos, T x)
+    {
+        size_t i = pos - b;
+        if (i == 0 && b != store) { *--b = std::move(x); return b; }
+        // the first insert at the front of a big enough array makes as much room there as there are items
+        if (i == 0 && size() >= 16) { realloc(size() * 2, size()); *--b = std::move(x); return b; }
+        grow_back();
+        std::move_backward(b + i, e, e + 1);
+        e++;
+        b[i] = std::move(x);
+        return b + i;
+    }
+    template<typename It>
+    iterator insert(const_iterator pos, It first, It last)
+    {
+        size_t i = pos - b, n = std::distance(first, last);
+        if (size() + n > capacity()) realloc(std::max(size() + n, size() * 2));
+        std::move_backward(b + i, e, e + n);
+        e += n;
+        std::copy(first, last, b + i);
+        return b + i;
+    }
+    iterator erase(const_iterator pos) { return erase(pos, pos + 1); }
+    iterator erase(const_iterator first, const_iterator last)
+    {
+        size_t i = first - b, n = last - first;
+        if (i == 0)
+        {
+            for (auto p = b; p != b + n; p++) *p = T();
+            b += n;
+        }
+        else
+        {
+            auto ne = std::move(b + i + n, e, b + i);
+            for (auto p = ne; p != e; p++) *p = T();
+            e = ne;
+        }
+        if (e == b) b = e = store;
+        return b + i;
+    }
+    
+    // n items starting at start of the given storage, without copying them. views of views borrow from the original
+    static ArrayStorage view(const shared_ptr<ArrayStorage> & of, size_t start, size_t n)
+    {
+        ArrayStorage ret;
+        ret.base = of->base ? of->base : of;
+        ret.b = of->b + start;
+        ret.e = ret.b + n;
+        return ret;
+    }
+};
+// an ArrayStorage with room for its first N items allocated along with it, so that make_shared puts the refcounts,
+// the storage and the items all in one allocation. for arrays whose size is known when they're made, e.g. [ x y [] [] 0 ].
+// if one grows past N, its items move onto the heap like usual
+template<typename T, size_t N>
+struct InlineArrayStorage : ArrayStorage<T> {
+    T slots[N];
+    InlineArrayStorage() { this->local = this->store = this->b = this->e = slots; this->cap = N; }
+};
+
+typedef ArrayStorage<DynamicType> ArrayStore;
+
+typedef shared_ptr<ArrayStore> ArrayData;
+
+// refcounts are plain integers, except on things that might be touched by several threads at once (see !parallel_for)
+inline void refcount_inc(size_t & n, bool shared) { if (shared) __atomic_add_fetch(&n, 1, __ATOMIC_RELAXED); else n += 1; }
+inline size_t refcount_dec(size_t & n, bool shared) { return shared ? __atomic_sub_fetch(&n, 1, __ATOMIC_ACQ_REL) : --n; }
+
+// what an allocation was for, as counted by INTERPRETER_ALLOC_STATS (see allocstats.hpp)
+enum AllocKind { AllocFrame, AllocArray, AllocRef, AllocCopy, AllocClone, AllocConcat, AllocGrow, AllocKindCount };
+
+#ifdef INTERPRETER_ALLOC_STATS
+#include "allocstats.hpp"
+#define ALLOC_NOTE(KIND, BYTES) alloc_note(KIND, BYTES);
+#define ALLOC_RESIZED(ITEMS, KIND) alloc_array_resized(ITEMS, KIND);
+#else
+#define ALLOC_NOTE(KIND, BYTES)
+#define ALLOC_RESIZED(ITEMS, KIND)
+#endif
 
 struct PointerInfo {
     ArrayData items;
     DynamicType * refdata;
     size_t n;
+    bool shared = false;
+    bool cow = false; // items is borrowed from a Snapshot or shared with slices, and has to be copied before anything writes to it
+    // references made by indexing into an array are linked into a list on the array's control block, so that resizing it
+    // only has to detach them instead of copying the whole array (see Array::dirtify).
+    // for an array, link is the first linked reference; for a reference, it's the array, and next/prev are its siblings
+    uint32_t nrefs = 0;
+    PointerInfo * link = nullptr;
+    PointerInfo * next = nullptr;
+    PointerInfo * prev = nullptr;
 };
 
+// called when a control block is released: a reference leaves its array's list, an array lets go of its references
+inline void pointer_info_unlink(PointerInfo * p)
+{
+    if (p->refdata)
+    {
+        if (p->prev) p->prev->next = p->next;
+        else p->link->link = p->next;
+        if (p->next) p->next->prev = p->prev;
+        p->link->nrefs -= 1;
+    }
+    else
+    {
+        for (auto r = p->link; r; ) { auto next = r->next; r->link = r->next = r->prev = nullptr; r = next; }
+        p->nrefs = 0;
+    }
+    p->link = nullptr;
+}
+
 struct PointerInfoPtr {
     PointerInfo * p;
     
     // hold on to a few control blocks, because rapidly allocating and freeing them is expensive on some OSs like windows
-    static PointerInfo * freed_pointers[64];
-    static size_t freed_pointers_n;
+    // per-thread, so that separate interpreters can run on separate threads
+    static thread_local PointerInfo * freed_pointers[64];
+    static thread_local size_t freed_pointers_n;
 
     PointerInfoPtr(ArrayData & items, DynamicType * addr)
     {
+        ALLOC_NOTE(AllocRef, sizeof(PointerInfo)) // counted even when it comes out of the cache
         if (freed_pointers_n)
         {
             p = freed_pointers[--freed_pointers_n];
@@ -120,19 +336,24 @@ struct PointerInfoPtr {
     }
     void rdec()
     {
-        if (!p || --(p->n)) return;
-        if (freed_pointers_n + 1 >= sizeof(freed_pointers)/sizeof(freed_pointers[0])) { delete p; p = nullptr; return; }
-        p->items = 0;
-        freed_pointers[freed_pointers_n++] = p;
+        if (!p || refcount_dec(p->n, p->shared)) return;
+        auto q = p;
+        p = nullptr;
+        if (q->link) pointer_info_unlink(q);
+        // releasing the items can recursively release other control blocks, so the cache check has to come after it
+        q->items = 0;
+        if (freed_pointers_n >= sizeof(freed_pointers)/sizeof(freed_pointers[0])) { delete q; return; }
+        freed_pointers[freed_pointers_n++] = q;
     }
     ~PointerInfoPtr() { rdec(); }
-    PointerInfoPtr(const PointerInfoPtr & r) noexcept { p = r.p; if(p) p->n += 1; }
+    PointerInfoPtr(const PointerInfoPtr & r) noexcept { p = r.p; if(p) refcount_inc(p->n, p->shared); }
     PointerInfoPtr(PointerInfoPtr && r)      noexcept { p = r.p; r.p = nullptr; }
-    PointerInfoPtr & operator=(const PointerInfoPtr & r) noexcept { rdec(); p = r.p; if(p) p->n += 1; return *this; }
-    PointerInfoPtr & operator=(PointerInfoPtr && r)      noexcept { rdec(); p = r.p; r.p = nullptr; return *this; }
+    // r might live inside of the array that rdec() releases, so grab it first
+    PointerInfoPtr & operator=(const PointerInfoPtr & r) noexcept { auto q = r.p; if(q) refcount_inc(q->n, q->shared); rdec(); p = q; return *this; }
+    PointerInfoPtr & operator=(PointerInfoPtr && r)      noexcept { auto q = r.p; r.p = nullptr; rdec(); p = q; return *this; }
 };
-PointerInfo * PointerInfoPtr::freed_pointers[] = {};
-size_t PointerInfoPtr::freed_pointers_n = 0;
+thread_local PointerInfo * PointerInfoPtr::freed_pointers[] = {};
+thread_local size_t PointerInfoPtr::freed_pointers_n = 0;
 
 struct Ref {
     PointerInfoPtr info;
@@ -143,8 +364,13 @@ struct Ref {
 #define MAKEREF return Ref{PointerInfoPtr(items, &items.get()->at(i))};
 #define MAKEREF2 return Ref{PointerInfoPtr(items, items.get()->data() + i)};
 
-ArrayData make_array_data(vector<DynamicType> x) { return make_shared<vector<DynamicType>>(x); }
-ArrayData make_array_data() { return make_shared<vector<DynamicType>>(); }
+#ifdef INTERPRETER_ALLOC_STATS
+ArrayData make_array_data(ArrayStore x, AllocKind kind = AllocArray) { return alloc_array_data(std::move(x), kind); }
+ArrayData make_array_data(AllocKind kind = AllocArray) { return alloc_array_data(ArrayStore(), kind); }
+#else
+ArrayData make_array_data(ArrayStore x, AllocKind = AllocArray) { return make_shared<ArrayStore>(std::move(x)); }
+ArrayData make_array_data(AllocKind = AllocArray) { return make_shared<ArrayStore>(); }
+#endif
 
 struct Label { int loc; };
 struct Array {
@@ -155,15 +381,48 @@ struct Array {
     // this is done in a way where reference copies of the entire array stay pointing at the same data as each other, hence the double shared_ptr
     // importantly, the ptr we're checking for uniqueness here is the *inner* one, not the outer one!
     void dirtify();
+    // points the references linked to this array at cells of their own, if detach, or else just forgets about them
+    void unlink_refs(bool detach);
+    // own is called before handing out anything that can write to the array's items in place
+    void own() { if (info.p && info.p->cow) own_slow(); }
+    void own_slow();
     Array(PointerInfoPtr r) noexcept : info(r) { }
 };
 
 ArrayData & Array::items() { return info.p->items; }
 Array make_array(ArrayData backing) { return Array { PointerInfoPtr(backing, 0) }; }
 
+// hash map from numbers or arrays of numbers to anything. copies share the same table, like arrays do
+// intrusively refcounted so that it's pointer-sized and doesn't make DynamicType any bigger
+struct MapData;
+struct Map {
+    MapData * p;
+    void rdec();
+    Map(MapData * p) noexcept : p(p) { }
+    ~Map() { rdec(); }
+    Map(const Map & r) noexcept;
+    Map(Map && r)      noexcept { p = r.p; r.p = nullptr; }
+    Map & operator=(const Map & r) noexcept;
+    Map & operator=(Map && r)      noexcept { auto q = r.p; r.p = nullptr; rdec(); p = q; return *this; }
+};
+
+// coroutine: a function call with its own stacks, which can be suspended with yield and continued with resume
+// intrusively refcounted, like Map
+struct CoroData;
+struct Coro {
+    CoroData * p;
+    void rdec();
+    Coro(CoroData * p) noexcept : p(p) { }
+    ~Coro() { rdec(); }
+    Coro(const Coro & r) noexcept;
+    Coro(Coro && r)      noexcept { p = r.p; r.p = nullptr; }
+    Coro & operator=(const Coro & r) noexcept;
+    Coro & operator=(Coro && r)      noexcept { auto q = r.p; r.p = nullptr; rdec(); p = q; return *this; }
+};
+
 // DynamicType can hold any of these types
 struct DynamicType {
-    variant<int64_t, double, Label, Func, Ref, Array> value;
+    variant<int64_t, double, Label, Func, Ref, Array, Map, Coro> value;
 
     DynamicType() : value((int64_t)0) { }
     DynamicType(int64_t v) : value((int64_t)v) { }
@@ -175,8 +434,12 @@ struct DynamicType {
     DynamicType(const Func & f) : value(f) { }
     DynamicType(const Array & a) : value(a) { }
     DynamicType(const Ref & v) : value(v) { }
+    DynamicType(const Map & m) : value(m) { }
     DynamicType(Array && a) : value(a) { }
     DynamicType(Ref && v) : value(v) { }
+    DynamicType(Map && m) : value(std::move(m)) { }
+    DynamicType(const Coro & c) : value(c) { }
+    DynamicType(Coro && c) : value(std::move(c)) { }
 
     DynamicType(const DynamicType & other) = default;
     DynamicType(DynamicType && other) noexcept = default;
@@ -243,6 +506,8 @@ struct DynamicType {
     AS_TYPE_X(Label, label)
     AS_TYPE_X(Func, func)
     AS_TYPE_X(Array, array)
+    AS_TYPE_X(Map, map)
+    AS_TYPE_X(Coro, coro)
     
     bool is_int() { return holds_alternative<int64_t>(value); }
     bool is_double() { return holds_alternative<double>(value); }
@@ -250,6 +515,8 @@ struct DynamicType {
     bool is_label() { return holds_alternative<Label>(value); }
     bool is_func() { return holds_alternative<Func>(value); }
     bool is_array() { return holds_alternative<Array>(value); }
+    bool is_map() { return holds_alternative<Map>(value); }
+    bool is_coro() { return holds_alternative<Coro>(value); }
     
     int64_t as_into_int()
     {
@@ -264,6 +531,13 @@ struct DynamicType {
         else if (is_ref() && as_ref().ref()->is_array()) return &as_ref().ref()->as_array();
         else THROWSTR("Tried to use a non-array value as an array");
     }
+    
+    Map * as_map_ptr_thru_ref()
+    {
+        if (is_map()) return &as_map();
+        else if (is_ref() && as_ref().ref()->is_map()) return &as_ref().ref()->as_map();
+        else THROWSTR("Tried to use a non-map value as a map");
+    }
         
     explicit operator bool() const
     {
@@ -272,36 +546,418 @@ struct DynamicType {
         return true;
     }
     
-    DynamicType clone(bool deep)
+    DynamicType clone(bool deep);
+};
+
+template<size_t N>
+ArrayData make_inline_array_data(AllocKind kind)
+{
+#ifdef INTERPRETER_ALLOC_STATS
+    return alloc_array_data_as<ArrayStore>(new InlineArrayStorage<DynamicType, N>(), kind);
+#else
+    (void)kind;
+    return make_shared<InlineArrayStorage<DynamicType, N>>();
+#endif
+}
+// an empty array with room for n items. most arrays that scripts make are tiny (pairs, bound calls, small lists),
+// so anything that fits in 4 gets those 4 inline, and only allocates again if it grows past them
+ArrayData make_array_data_with_room(size_t n, AllocKind kind = AllocArray)
+{
+    if (n <= 4) return make_inline_array_data<4>(kind);
+    ArrayStore x;
+    x.reserve(n);
+    return make_array_data(std::move(x), kind);
+}
+// array literals know their size up front, so ones that are a bit bigger than that also get exactly as much inline room as they need
+ArrayData make_literal_array_data(vector<DynamicType> && x)
+{
+    ArrayData d;
+    switch (x.size())
     {
-        if (is_ref()) return *as_ref().ref();
-        else if (!is_array()) return *this;
-        auto n = make_array(make_array_data(*as_array().items()));
-        if (!deep) return n;
-        for (auto & item : *n.items()) item = item.clone(deep);
-        return n;
+    case 5: d = make_inline_array_data<5>(AllocArray); break;
+    case 6: d = make_inline_array_data<6>(AllocArray); break;
+    case 7: d = make_inline_array_data<7>(AllocArray); break;
+    case 8: d = make_inline_array_data<8>(AllocArray); break;
+    default: d = make_array_data_with_room(x.size());
     }
-};
+    for (auto & item : x) *d->e++ = std::move(item);
+    return d;
+}
 
 inline Ref make_ref(ArrayData & items, size_t i) { MAKEREF }
 inline Ref make_ref_2(ArrayData & items, size_t i) { MAKEREF2 }
+// a reference to an array element, linked to the array so that resizing the array can detach it cheaply.
+// arrays shared between threads can't be resized anyway, and their lists aren't thread safe, so those aren't linked
+inline Ref make_element_ref(Array & a, size_t i)
+{
+    Ref r = make_ref(a.items(), i);
+    auto p = a.info.p, q = r.info.p;
+    if (!p->shared)
+    {
+        q->link = p;
+        q->next = p->link;
+        if (p->link) p->link->prev = q;
+        p->link = q;
+        p->nrefs += 1;
+    }
+    return r;
+}
 
-//NOINLINE void Array::dirtify() { if (info && info->n != 1) info->items = make_array_data(*info->items); }
-NOINLINE void Array::dirtify()
+NOINLINE void dirtify_data(ArrayData & items)
 {
-    if (info.p && !info.p->items.unique())
+    if (!items.unique())
     {
-        auto old = info.p->items;
-        info.p->items = make_array_data(*info.p->items.get());
+        auto old = items;
+        items = make_array_data(*items.get(), AllocCopy);
         for (auto & x : *old) x = 0;
     }
 }
+//NOINLINE void Array::dirtify() { if (info && info->n != 1) info->items = make_array_data(*info->items); }
+void Array::own_slow()
+{
+    // nothing else is looking at the items anymore (e.g. every slice of them is gone), so there's nothing to copy
+    if (info.p->items.use_count() == 1 && !info.p->items->base) return (void)(info.p->cow = false);
+    info.p->items = make_array_data(*info.p->items, AllocCopy);
+    info.p->cow = false;
+}
+void Array::unlink_refs(bool detach)
+{
+    for (auto r = info.p->link; r; )
+    {
+        auto next = r->next;
+        if (detach)
+        {
+            // stale references read as 0 and writes to them go nowhere, same as if the array had been copied away from them
+            r->items = make_array_data(vector<DynamicType>(1));
+            r->refdata = r->items->data();
+        }
+        r->link = r->next = r->prev = nullptr;
+        r = next;
+    }
+    info.p->link = nullptr;
+    info.p->nrefs = 0;
+}
+void Array::dirtify()
+{
+    if (!info.p) return;
+    own(); // before dirtify_data, which would otherwise zero out the borrowed items
+    if (info.p->shared) THROWSTR("Tried to resize an array that's shared between threads");
+    if (!info.p->link) return dirtify_data(info.p->items);
+    // if the only other owners are linked references, detaching them is enough, and costs per reference instead of per element
+    bool only_refs = (size_t)info.p->items.use_count() == 1 + info.p->nrefs;
+    unlink_refs(only_refs);
+    if (!only_refs) dirtify_data(info.p->items);
+}
 //NOINLINE void Array::dirtify() { }
 
+// no other handle, reference or slice shares a's items, so they can be changed in place without anyone noticing
+inline bool array_is_unique(Array & a)
+{
+    auto p = a.info.p;
+    return !p->shared && p->n == 1 && !p->cow && p->items.use_count() == 1;
+}
+
+// nothing can write to a's items without going through own() first (i.e. there are no references into them),
+// so they can be shared with another array. both sides then get marked cow, so whichever gets written to first copies,
+// and the other keeps the old items
+inline bool array_can_share(Array & a)
+{
+    auto p = a.info.p;
+    return !p->shared && (p->cow || p->items.use_count() == 1);
+}
+
+// n items of a, starting at start, as a new array. big enough slices are views that share a's items instead of copying them
+Array array_slice(Array & a, size_t start, size_t n)
+{
+    auto p = a.info.p;
+    auto & items = p->items;
+    if (start > items->size() || n > items->size() - start) THROWSTR("tried to access past end of array");
+    if (n < 16 || !array_can_share(a))
+    {
+        auto ret = make_array(make_array_data_with_room(n));
+        ret.items()->insert(ret.items()->end(), items->data() + start, items->data() + start + n);
+        return ret;
+    }
+    p->cow = true;
+    auto ret = make_array(make_array_data(ArrayStore::view(items, start, n)));
+    ret.info.p->cow = true;
+    return ret;
+}
+
+// open addressing with linear probing. keys and values are stored densely, in insertion order (until something is deleted)
+// and the slots hold indexes into them. values live in an ArrayData so that references to them work like array references
+struct MapData {
+    size_t n = 1;
+    bool shared = false;
+    ArrayData keys = make_array_data();
+    ArrayData values = make_array_data();
+    vector<uint32_t> slots;
+    size_t tombstones = 0;
+    
+    static const uint32_t tombstone = (uint32_t)-1;
+    
+    static uint64_t mix(uint64_t x)
+    {
+        x ^= x >> 33; x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33; x *= 0xc4ceb9fe1a85ec53ULL;
+        return x ^ (x >> 33);
+    }
+    static uint64_t hash(DynamicType & k, bool nested = false)
+    {
+        if (k.is_int()) return mix(k.as_int());
+        if (k.is_double())
+        {
+            // doubles that are equal to an int must hash like that int, since they compare equal to it
+            double d = k.as_double();
+            if (d >= -9.2e18 && d <= 9.2e18 && d == (double)(int64_t)d) return mix((int64_t)d);
+            if (std::isnan(d)) d = NAN; // every nan is the same key, whatever its sign and payload
+            uint64_t bits;
+            memcpy(&bits, &d, sizeof(d));
+            return mix(bits);
+        }
+        if (k.is_array() && !nested)
+        {
+            uint64_t h = 0x9e3779b97f4a7c15ULL;
+            for (auto & x : *k.as_array().items()) h = mix(h ^ hash(x, true));
+            return h;
+        }
+        THROWSTR("Map keys must be numbers or arrays of numbers");
+    }
+    // like ==, except that nan equals nan, otherwise a nan key could never be found again and every insert would add another
+    static bool equal_number(DynamicType & a, DynamicType & b)
+    {
+        if (a == b) return true;
+        return a.is_double() && b.is_double() && std::isnan(a.as_double()) && std::isnan(b.as_double());
+    }
+    static bool equal(DynamicType & a, DynamicType & b)
+    {
+        if (a.is_array() != b.is_array()) return false;
+        if (!a.is_array()) return equal_number(a, b);
+        auto & la = *a.as_array().items();
+        auto & lb = *b.as_array().items();
+        if (la.size() != lb.size()) return false;
+        for (size_t i = 0; i < la.size(); i++) { if (!equal_number(la[i], lb[i])) return false; }
+        return true;
+    }
+    
+    size_t size() { return keys->size(); }
+    
+    // returns the slot index holding the key, or the empty slot it would go in
+    size_t probe(DynamicType & key, uint64_t h)
+    {
+        size_t mask = slots.size() - 1;
+        size_t found = (size_t)-1;
+        for (size_t i = h & mask; ; i = (i + 1) & mask)
+        {
+            auto s = slots[i];
+            if (s == 0) return found != (size_t)-1 ? found : i;
+            if (s == tombstone) { if (found == (size_t)-1) found = i; }
+            else if (equal((*keys)[s - 1], key)) return i;
+        }
+    }
+    int64_t find(DynamicType & key)
+    {
+        if (!slots.size()) return -1;
+        auto s = slots[probe(key, hash(key))];
+        return (s == 0 || s == tombstone) ? -1 : (int64_t)s - 1;
+    }
+    void rehash(size_t capacity)
+    {
+        slots = vector<uint32_t>(capacity, 0);
+        tombstones = 0;
+        for (size_t i = 0; i < keys->size(); i++)
+            slots[probe((*keys)[i], hash((*keys)[i]))] = i + 1;
+    }
+    // returns the index of the key's value, inserting a 0 if it isn't there yet.
+    // adding a key while a map_ref into the values is alive copies them (O(n)) and leaves that ref stale,
+    // reading 0 and writing nowhere, the same as a reference into an array that gets resized
+    size_t insert(DynamicType & key)
+    {
+        auto h = hash(key);
+        if ((size() + tombstones + 1) * 4 > slots.size() * 3)
+        {
+            size_t capacity = 8;
+            while ((size() + 1) * 2 > capacity) capacity *= 2;
+            rehash(capacity);
+        }
+        auto i = probe(key, h);
+        if (slots[i] != 0 && slots[i] != tombstone) return slots[i] - 1;
+        if (size() >= tombstone - 1) THROWSTR("Map has too many items");
+        if (shared) THROWSTR("Tried to add to a map that's shared between threads");
+        tombstones -= slots[i] == tombstone;
+        
+        dirtify_data(values);
+        keys->push_back(key.is_array() ? key.clone(false) : key);
+        values->push_back(0);
+        slots[i] = size();
+        return size() - 1;
+    }
+    bool erase(DynamicType & key)
+    {
+        if (!slots.size()) return false;
+        auto i = probe(key, hash(key));
+        if (slots[i] == 0 || slots[i] == tombstone) return false;
+        if (shared) THROWSTR("Tried to remove from a map that's shared between threads");
+        size_t index = slots[i] - 1;
+        slots[i] = tombstone;
+        tombstones += 1;
+        
+        // keep storage dense by moving the last item into the hole
+        dirtify_data(values);
+        size_t last = size() - 1;
+        if (index != last)
+        {
+            slots[probe((*keys)[last], hash((*keys)[last]))] = index + 1;
+            (*keys)[index] = std::move((*keys)[last]);
+            (*values)[index] = std::move((*values)[last]);
+        }
+        keys->pop_back();
+        values->pop_back();
+        return true;
+    }
+};
+
+void Map::rdec()
+{
+    if (!p || refcount_dec(p->n, p->shared)) return;
+    auto q = p;
+    p = nullptr;
+    delete q;
+}
+Map::Map(const Map & r) noexcept { p = r.p; if (p) refcount_inc(p->n, p->shared); }
+Map & Map::operator=(const Map & r) noexcept { auto q = r.p; if (q) refcount_inc(q->n, q->shared); rdec(); p = q; return *this; }
+Map make_map() { return Map { new MapData() }; }
+
+// marks a coroutine, and queues up the values on its stacks; defined along with the rest of the coroutine code
+bool coro_set_shared(CoroData * c, bool shared, vector<DynamicType *> & todo);
+
+// marks (or unmarks) everything reachable from v as being reachable from several threads at once, making its refcounting atomic.
+// things that are already marked aren't looked inside of again, which also takes care of cycles
+void set_shared(DynamicType & v, bool shared)
+{
+    vector<DynamicType *> todo = {&v};
+    while (todo.size())
+    {
+        auto x = vec_pop_back(todo);
+        if (x->is_map())
+        {
+            auto m = x->as_map().p;
+            if (!m || m->shared == shared) continue;
+            m->shared = shared;
+            for (auto & y : *m->values) todo.push_back(&y);
+            continue;
+        }
+        if (x->is_coro())
+        {
+            coro_set_shared(x->as_coro().p, shared, todo);
+            continue;
+        }
+        PointerInfo * info = x->is_array() ? x->as_array().info.p : x->is_ref() ? x->as_ref().info.p : nullptr;
+        if (!info || info->shared == shared) continue;
+        if (x->is_array()) x->as_array().own(); // while there's still only one thread that could be doing it
+        info->shared = shared;
+        if (x->is_array()) for (auto & y : *info->items) todo.push_back(&y);
+        else todo.push_back(info->refdata);
+    }
+}
+
+// ::!, without recursing on the C++ stack, so that deep structures can't overflow it. arrays that only hold plain values
+// aren't copied: the clone shares their items copy-on-write, like a snapshot does, so up front it only copies the levels
+// that hold other arrays or maps. like the other clones, shared subarrays get cloned once per place they appear
+DynamicType clone_deep(DynamicType & root)
+{
+    // levels of the clone whose items are still being gone through, and what they're clones of, to catch cycles
+    struct Level { ArrayStore * items; size_t i; const void * from; };
+    vector<Level> path;
+    unordered_set<const void *> on_path;
+    
+    // replaces v with a clone of it
+    auto visit = [&](DynamicType & v) {
+        if (v.is_ref()) { v = DynamicType(*v.as_ref().ref()); return; }
+        if (!v.is_array() && !v.is_map()) return;
+        const void * from = v.is_array() ? (const void *)v.as_array().info.p : (const void *)v.as_map().p;
+        if (on_path.count(from)) THROWSTR("Tried to deep clone something that contains itself");
+        if (v.is_array() && array_can_share(v.as_array()))
+        {
+            auto & a = v.as_array();
+            bool plain = true;
+            for (auto & x : *a.items()) { if (x.is_array() || x.is_ref() || x.is_map() || x.is_coro()) { plain = false; break; } }
+            if (plain)
+            {
+                a.info.p->cow = true;
+                auto n = make_array(a.items());
+                n.info.p->cow = true;
+                v = std::move(n);
+                return;
+            }
+        }
+        v = v.clone(false);
+        path.push_back({v.is_array() ? v.as_array().items().get() : v.as_map().p->values.get(), 0, from});
+        on_path.insert(from);
+    };
+    
+    DynamicType ret = root;
+    visit(ret);
+    while (path.size())
+    {
+        auto & level = path.back();
+        if (level.i == level.items->size())
+        {
+            on_path.erase(level.from);
+            path.pop_back();
+            continue;
+        }
+        visit((*level.items)[level.i++]); // can add to path, so level can't be used after this
+    }
+    return ret;
+}
+
+DynamicType DynamicType::clone(bool deep)
+{
+    if (is_ref()) return *as_ref().ref();
+    if (deep) return clone_deep(*this);
+    else if (is_map())
+    {
+        auto & old = *as_map().p;
+        auto n = make_map();
+        n.p->keys = make_array_data(*old.keys, AllocClone);
+        n.p->values = make_array_data(*old.values, AllocClone);
+        n.p->slots = old.slots;
+        n.p->tombstones = old.tombstones;
+        return n;
+    }
+    else if (!is_array()) return *this;
+    auto & items = *as_array().items();
+    auto n = make_array(make_array_data_with_room(items.size(), AllocClone));
+    n.items()->insert(n.items()->end(), items.begin(), items.end());
+    return n;
+}
+
+// a ForLoopLocal, ForLoopLocalLen or ForLoopLocalVar loop whose body is simple enough to run natively instead of token by token
+// (see compile_loop_kernels):
+// statements like ( a @ i * 2 + b @ i -> $c @ i ), where i is the loop's counter and everything else is local arrays indexed by it,
+// local numbers and constants. ops are the body in postfix order, with each statement ending in a KStore
+struct LoopKernel {
+    static constexpr size_t max_arrays = 8;
+    static constexpr size_t max_depth = 16;
+    enum OpKind : uint8_t { KLoad, KCounter, KLocal, KInt, KDouble, KAdd, KSub, KMul, KDiv, KMod, KNeg, KStore };
+    struct Op { OpKind kind; iword_t n; int64_t i; double d; };
+    vector<Op> ops;
+    vector<iword_t> arrays; // local slots of the indexed arrays. KLoad and KStore refer to them by position
+    vector<bool> stored; // per array, whether anything is stored into it
+    vector<iword_t> starts; // first token of each statement, for handing the rest of an iteration back to the bytecode
+    iword_t body;
+    // what the loop counts up to: the ForLoopKernel token's extra_2 itself, the local in that slot, or that local array's length.
+    // it's read every time the token runs, i.e. once per entry into the kernel; nothing the kernel runs can change it
+    enum BoundKind : uint8_t { BoundConst, BoundLocal, BoundLen };
+    BoundKind bound = BoundConst;
+};
+
 struct Program {
     vector<Token> program;
     vector<int> lines;
     vector<CompFunc> funcs;
+    vector<LoopKernel> loop_kernels;
     
     #define TOKEN_LOG(NAME, TYPE)\
     vector<TYPE> token_##NAME##s;\
@@ -322,9 +978,507 @@ struct Program {
     TOKEN_LOG(stringref, ArrayData)
 };
 
+#if defined(INTERPRETER_PROFILE) || defined(INTERPRETER_SAMPLE)
+#include "profile.hpp"
+#endif
+
+// the sampling profiler mustn't look at the call stack while it's being reallocated or swapped
+#ifdef INTERPRETER_SAMPLE
+#define SAMPLE_GUARDED(X) { s.sample.busy = 1; std::atomic_signal_fence(std::memory_order_seq_cst); X; \
+    std::atomic_signal_fence(std::memory_order_seq_cst); s.sample.busy = 0; }
+#else
+#define SAMPLE_GUARDED(X) X;
+#endif
+
+// where printed text ends up. embedders can point this at their own buffers instead of stdout
+struct OutputSink {
+    void * userdata;
+    void (*write)(void * userdata, const char * data, size_t len);
+};
+void stdout_sink_write(void *, const char * data, size_t len) { fwrite(data, 1, len, stdout); fflush(stdout); }
+OutputSink stdout_sink() { return {nullptr, stdout_sink_write}; }
+
+// printing goes through this instead of stdio, so that printing lots of small things doesn't cost a call into stdio each
+struct OutputBuffer {
+    OutputSink sink;
+    vector<char> data = vector<char>(1 << 14);
+    size_t len = 0;
+    
+    OutputBuffer(OutputSink sink) : sink(sink) { }
+    OutputBuffer(const OutputBuffer &) = delete;
+    ~OutputBuffer() { flush(); }
+    
+    void flush()
+    {
+        // emptied first, so that if the sink throws, the destructor doesn't try again (and throw out of a destructor)
+        auto n = len;
+        len = 0;
+        if (n) sink.write(sink.userdata, data.data(), n);
+    }
+    void write(const char * s, size_t n)
+    {
+        if (len + n > data.size()) flush();
+        if (n > data.size()) return sink.write(sink.userdata, s, n);
+        memcpy(data.data() + len, s, n);
+        len += n;
+    }
+    void write(const char * s) { write(s, strlen(s)); }
+    void put(char c)
+    {
+        if (len == data.size()) flush();
+        data[len++] = c;
+    }
+    void put_int(int64_t x)
+    {
+        char s[24];
+        write(s, to_chars(s, s + sizeof(s), x).ptr - s);
+    }
+    void put_double(double x)
+    {
+        char s[32];
+        write(s, to_chars(s, s + sizeof(s), x, chars_format::general, 17).ptr - s);
+    }
+};
+
+// where !read_line gets its bytes from. same idea as OutputSink; returns 0 at end of input
+struct InputSource {
+    void * userdata;
+    size_t (*read)(void * userdata, char * data, size_t len);
+};
+// read() hands back whatever has arrived so far; fread would wait for a full buffer and stall on interactive/piped input
+size_t stdin_source_read(void *, char * data, size_t len)
+{
+#ifndef _WIN32
+    while (1)
+    {
+        auto n = read(0, data, len);
+        if (n >= 0) return n;
+        if (errno != EINTR) return 0;
+    }
+#else
+    return fread(data, 1, len, stdin);
+#endif
+}
+InputSource stdin_source() { return {nullptr, stdin_source_read}; }
+
+struct InputBuffer {
+    InputSource source;
+    vector<char> data = vector<char>(1 << 16);
+    size_t pos = 0;
+    size_t len = 0;
+    
+    InputBuffer(InputSource source) : source(source) { }
+    InputBuffer(const InputBuffer &) = delete;
+    
+    bool refill()
+    {
+        pos = 0;
+        len = source.read(source.userdata, data.data(), data.size());
+        return len != 0;
+    }
+};
+
+struct ProgramState {
+    const Program & programdata;
+    const vector<CompFunc> & funcs;
+    vector<DynamicType> vars_default;
+    vector<iword_t> callstack;
+    
+    ArrayData globals;
+    DynamicType * globals_raw;
+    
+    vector<ArrayData> varstacks;
+    ArrayData varstack;
+    DynamicType * varstack_raw;
+    
+    vector<vector<DynamicType>> evalstacks;
+    vector<DynamicType> evalstack;
+    
+    OutputBuffer out;
+    InputBuffer in;
+    
+    // reference-type string literals can be written to, so each state gets its own copy of them, made on first use.
+    // this keeps the Program itself read-only, so it can be shared between threads
+    vector<ArrayData> stringrefs;
+    
+    // set on the states that !parallel_for runs its workers on
+    bool in_parallel = false;
+    
+    // the coroutine that's currently running, if any, and how many native calls (call_func) deep we are
+    Coro coro = nullptr;
+    int native_depth = 0;
+    
+    // counts down on every jump and call. when it runs out, interpreter_core stops early and returns
+    // where to continue from (also kept in preempted_at); calling it again with that index picks back up
+    int64_t budget = INT64_MAX;
+    int preempted_at = -1;
+    
+    #ifdef INTERPRETER_PROFILE
+    Profile profile = Profile(programdata.program.size());
+    #endif
+    #ifdef INTERPRETER_SAMPLE
+    SamplePoint sample;
+    #endif
+    
+    ProgramState(const Program & programdata, OutputSink sink = stdout_sink(), InputSource source = stdin_source()) :
+        programdata(programdata), funcs(programdata.funcs), vars_default(programdata.token_varnames.size(), DynamicType(0)),
+        globals(make_array_data(vars_default, AllocFrame)), globals_raw(globals->data()),
+        varstack(make_array_data(vars_default, AllocFrame)), varstack_raw(varstack->data()), out(sink), in(source),
+        stringrefs(programdata.token_stringrefs.size())
+    {
+        #ifdef INTERPRETER_SAMPLE
+        sample.callstack = &callstack;
+        #endif
+    }
+    ArrayData & get_stringref(iword_t n)
+    {
+        if (!stringrefs[n]) stringrefs[n] = make_array_data(*programdata.get_token_stringref(n));
+        return stringrefs[n];
+    }
+};
+
+// a suspended coroutine keeps its stacks here. while it's running, they're swapped into the ProgramState,
+// and the stacks of whatever resumed it are kept here instead, so switching never copies any stacks
+struct CoroData {
+    size_t n = 1;
+    bool shared = false;
+    vector<iword_t> callstack;
+    vector<ArrayData> varstacks;
+    ArrayData varstack;
+    vector<vector<DynamicType>> evalstacks;
+    vector<DynamicType> evalstack;
+    int ip; // where to continue the coroutine from, or, while it's running, where to return to on yield
+    int native_depth = 0;
+    Coro prev = nullptr; // whatever coroutine (if any) was running when this one got resumed
+    bool running = false;
+    bool done = false;
+};
+
+void Coro::rdec()
+{
+    if (!p || refcount_dec(p->n, p->shared)) return;
+    auto q = p;
+    p = nullptr;
+    delete q;
+}
+Coro::Coro(const Coro & r) noexcept { p = r.p; if (p) refcount_inc(p->n, p->shared); }
+Coro & Coro::operator=(const Coro & r) noexcept { auto q = r.p; if (q) refcount_inc(q->n, q->shared); rdec(); p = q; return *this; }
+
+// a shared coroutine can't be resumed (see coro_resume), so only its refcount and the values it holds need to be thread safe.
+// prev is only set while it's running, and only the thread running it ever looks at that
+bool coro_set_shared(CoroData * c, bool shared, vector<DynamicType *> & todo)
+{
+    if (!c || c->shared == shared) return false;
+    c->shared = shared;
+    for (auto & y : c->evalstack) todo.push_back(&y);
+    for (auto & e : c->evalstacks) for (auto & y : e) todo.push_back(&y);
+    if (c->varstack) for (auto & y : *c->varstack) todo.push_back(&y);
+    for (auto & frame : c->varstacks) if (frame) for (auto & y : *frame) todo.push_back(&y);
+    return true;
+}
+
+// the coroutine starts out as if it had been called from the CoroEnd token at the very end of the program
+Coro make_coro(const Program & programdata, Func f)
+{
+    auto c = Coro { new CoroData() };
+    c.p->callstack.push_back(programdata.program.size() - 1);
+    c.p->varstacks.push_back(make_array_data(AllocFrame));
+    c.p->varstack = make_array_data(vector(f.varcount, DynamicType(0)), AllocFrame);
+    c.p->ip = f.loc;
+    return c;
+}
+
+void coro_swap_stacks(ProgramState & s, CoroData & c)
+{
+    SAMPLE_GUARDED(std::swap(s.callstack, c.callstack))
+    std::swap(s.varstacks, c.varstacks);
+    std::swap(s.varstack, c.varstack);
+    std::swap(s.evalstacks, c.evalstacks);
+    std::swap(s.evalstack, c.evalstack);
+    s.varstack_raw = s.varstack->data();
+}
+// both of these take the index to continue from and return the index to jump to
+int coro_resume(ProgramState & s, Coro & c, int i)
+{
+    if (c.p->done) THROWSTR("Tried to resume a coroutine that has already finished");
+    if (c.p->running) THROWSTR("Tried to resume a coroutine that's already running");
+    if (c.p->shared) THROWSTR("Tried to resume a coroutine that's shared between threads");
+    c.p->running = true;
+    c.p->native_depth = s.native_depth;
+    coro_swap_stacks(s, *c.p);
+    std::swap(c.p->ip, i);
+    c.p->prev = std::move(s.coro);
+    s.coro = c;
+    return i;
+}
+int coro_suspend(ProgramState & s, int i)
+{
+    if (!s.coro.p) THROWSTR("Tried to yield outside of a coroutine");
+    Coro c = std::move(s.coro);
+    if (c.p->native_depth != s.native_depth) THROWSTR("Tried to yield from inside of a function called by a builtin");
+    c.p->running = false;
+    coro_swap_stacks(s, *c.p);
+    std::swap(c.p->ip, i);
+    s.coro = std::move(c.p->prev);
+    return i;
+}
+// after an error, puts back the stacks of whatever resumed each coroutine that was still running, back down to until.
+// those coroutines stop there: there's nowhere left to continue them from, so they count as finished
+void coro_unwind(ProgramState & s, CoroData * until)
+{
+    while (s.coro.p && s.coro.p != until)
+    {
+        Coro c = std::move(s.coro);
+        c.p->running = false;
+        c.p->done = true;
+        coro_swap_stacks(s, *c.p);
+        s.coro = std::move(c.p->prev);
+        c.p->callstack.clear();
+        c.p->varstacks.clear();
+        c.p->evalstacks.clear();
+        c.p->evalstack.clear();
+    }
+}
+
+// returns -1 once the program exits, or the index to continue from if it ran out of budget
+int interpreter_core(ProgramState & s, int i);
+void call_func(ProgramState & s, Func f, ArrayData * frame = nullptr);
+
 // built-in function definitions. must be specifically here. do not move.
 #include "builtins.hpp"
 
+// turns ForLoopLocal, ForLoopLocalLen and ForLoopLocalVar loops into ForLoopKernel ones when their body is nothing but
+// statements a LoopKernel can run.
+// runs after labels are resolved, since it needs to know where each loop's body starts
+void compile_loop_kernels(Program & programdata)
+{
+    auto & p = programdata.program;
+    for (size_t f = 0; f < p.size(); f++)
+    {
+        auto kind = p[f].kind;
+        if ((kind != ForLoopLocal && kind != ForLoopLocalLen && kind != ForLoopLocalVar) || p[f].n >= f) continue;
+        auto counter = p[f].extra_1;
+        if (kind != ForLoopLocal && p[f].extra_2 == counter) continue;
+        LoopKernel k;
+        k.body = p[f].n;
+        k.bound = kind == ForLoopLocal ? LoopKernel::BoundConst : kind == ForLoopLocalLen ? LoopKernel::BoundLen : LoopKernel::BoundLocal;
+        auto array = [&](iword_t slot) {
+            for (size_t a = 0; a < k.arrays.size(); a++) { if (k.arrays[a] == slot) return (iword_t)a; }
+            k.arrays.push_back(slot);
+            k.stored.push_back(false);
+            return (iword_t)(k.arrays.size() - 1);
+        };
+        auto indexed = [&](size_t j) { return j + 1 < f && p[j].kind == LocalVar && p[j].n == counter && p[j + 1].kind == ArrayIndex; };
+        auto op = [&](LoopKernel::OpKind kind, iword_t n = 0, int64_t i = 0, double d = 0.0) { k.ops.push_back({kind, n, i, d}); };
+        auto inline_double = [&](iword_t n) {
+            uint64_t dec = ((uint64_t)n) << iword_bits_from_i64;
+            double d;
+            memcpy(&d, &dec, sizeof(dec));
+            return d;
+        };
+        size_t depth = 0;
+        bool ok = true;
+        for (size_t j = k.body; ok && j < f; j++)
+        {
+            auto & t = p[j];
+            // Add/Sub/Mul/Div/Mod, in the same order as their inline variants
+            auto arith = [&](TKind first) { return LoopKernel::OpKind(LoopKernel::KAdd + (t.kind - first)); };
+            if (depth == 0) k.starts.push_back((iword_t)j);
+            
+            if (t.kind == LocalVar && t.n != counter && indexed(j + 1)) { op(LoopKernel::KLoad, array(t.n)); depth++; j += 2; }
+            else if (t.kind == LocalVarLookup && depth == 1 && indexed(j + 1) && j + 3 < f && p[j + 3].kind == Assign)
+            {
+                auto a = array(t.n);
+                k.stored[a] = true;
+                op(LoopKernel::KStore, a);
+                depth--;
+                j += 3;
+            }
+            else if (t.kind == LocalVar) { op(t.n == counter ? LoopKernel::KCounter : LoopKernel::KLocal, t.n); depth++; }
+            else if (t.kind == IntegerInline) { op(LoopKernel::KInt, 0, (iwordsigned_t)t.n); depth++; }
+            else if (t.kind == IntegerInlineBigDec) { op(LoopKernel::KInt, 0, ((int64_t)(iwordsigned_t)t.n) * 10000); depth++; }
+            else if (t.kind == IntegerInlineBigBin) { op(LoopKernel::KInt, 0, ((int64_t)(iwordsigned_t)t.n) << 15); depth++; }
+            else if (t.kind == Integer) { op(LoopKernel::KInt, 0, programdata.get_token_int(t.n)); depth++; }
+            else if (t.kind == DoubleInline) { op(LoopKernel::KDouble, 0, 0, inline_double(t.n)); depth++; }
+            else if (t.kind == Double) { op(LoopKernel::KDouble, 0, 0, programdata.get_token_double(t.n)); depth++; }
+            else if (t.kind >= Add && t.kind <= Mod && depth >= 2) { op(arith(Add)); depth--; }
+            else if (t.kind >= AddIntInline && t.kind <= ModIntInline && depth >= 1)
+            {
+                op(LoopKernel::KInt, 0, (iwordsigned_t)t.n);
+                op(arith(AddIntInline));
+            }
+            else if (t.kind >= AddDubInline && t.kind <= ModDubInline && depth >= 1)
+            {
+                op(LoopKernel::KDouble, 0, 0, inline_double(t.n));
+                op(arith(AddDubInline));
+            }
+            else if (t.kind == Neg && depth >= 1) op(LoopKernel::KNeg);
+            else ok = false;
+            
+            if (depth + 1 > LoopKernel::max_depth || k.arrays.size() > LoopKernel::max_arrays) ok = false;
+        }
+        if (!ok || depth != 0 || k.starts.empty()) continue;
+        
+        p[f].kind = ForLoopKernel;
+        p[f].n = (iword_t)programdata.loop_kernels.size();
+        programdata.loop_kernels.push_back(std::move(k));
+    }
+}
+
+// turns a @ i in the body of a ForLoopLocalLen loop over i and a into ArrayIndexUnchecked, where it can prove that
+// 0 <= i < a @? whenever the read happens. the loop token checks i < a @? right before jumping into the body, so it's enough
+// that nothing can get into the body any other way, that nothing in the body can change i or shrink a, and that i holds
+// an integer of at least -1 whenever the loop token runs, so that it's at least 0 once it has counted it up. only writes
+// to i that can reach this loop token matter, so other loops in the same function can reuse i however they like.
+// anything that doesn't fit (a call, a resize, a builtin that isn't known to be harmless, a reference to i or a that could
+// be written through later, ...) leaves the loop's reads checked
+void compile_unchecked_indexes(Program & programdata)
+{
+    auto & p = programdata.program;
+    const size_t outside = (size_t)-1;
+    
+    // where every jump comes from, by where it goes to. label values that aren't jumped to right away (:label goto)
+    // and function entries can be used from anywhere
+    vector<vector<size_t>> jumps_to(p.size());
+    auto jump = [&](size_t from, size_t to) { if (to < p.size()) jumps_to[to].push_back(from); };
+    for (size_t t = 0; t < p.size(); t++)
+    {
+        auto kind = p[t].kind;
+        if (kind == GotoLabel || kind == ForLoopLabel || kind == ForLoopLocal || kind == ForLoopLocalLen || kind == ForLoopLocalVar ||
+            (kind >= IfGotoLabel && kind <= IfGotoLabelGT))
+            jump(t, p[t].n);
+        else if (kind == ForLoopKernel)
+        {
+            auto & k = programdata.loop_kernels[p[t].n];
+            jump(t, k.body);
+            for (auto start : k.starts) jump(t, start);
+        }
+        else if (kind == LabelLookup)
+            jump(t + 1 < p.size() && (p[t + 1].kind == Goto || p[t + 1].kind == IfGoto) ? t : outside, p[t].n);
+    }
+    for (auto & f : programdata.funcs)
+        if (f.len) jump(outside, f.loc);
+    
+    // builtins that can't resize arrays, assign to locals or call back into the script
+    vector<iword_t> harmless;
+    for (auto name : { "print", "printstr", "first", "last", "dump", "sqrt", "flush", "map_get", "map_has", "map_len" })
+        harmless.push_back(builtins_lookup(name));
+    
+    auto is_loop = [&](const Token & t) {
+        return t.kind == ForLoopLocal || t.kind == ForLoopKernel || t.kind == ForLoopLocalLen || t.kind == ForLoopLocalVar;
+    };
+    // a ref to the local that gets used up right away by an assignment to it, or by indexing into it
+    auto assigns = [&](size_t t, size_t end) { return t + 1 < end && p[t + 1].kind == Assign && jumps_to[t + 1].empty(); };
+    auto indexes = [&](size_t t, size_t end) {
+        return (t + 1 < end && p[t + 1].kind == ArrayIndexConst) ||
+            (t + 2 < end && (p[t + 1].kind == LocalVar || p[t + 1].kind == IntegerInline) && p[t + 2].kind == ArrayIndex);
+    };
+    // a ref to the local that gets used up right away by an inc_goto_until with a simple bound, e.g. $i n :l inc_goto_until,
+    // which only ever counts it up
+    auto counts_up = [&](size_t t, size_t end) {
+        if (t + 2 >= end || !jumps_to[t + 1].empty() || !jumps_to[t + 2].empty()) return false;
+        auto bound = p[t + 1].kind;
+        return (bound == LocalVar || bound == GlobalVar || bound == IntegerInline || bound == Integer) && p[t + 2].kind == ForLoopLabel;
+    };
+    
+    for (auto & func : programdata.funcs)
+    {
+        if (!func.len) continue;
+        size_t func_end = func.loc + func.len - 1; // its FuncEnd
+        
+        // whether a local holds an integer >= -1 every time the given token runs. walks backwards from it over everything
+        // that can run before it, stopping at writes of constants like that (and at the function's entry, where it's 0).
+        // loops counting it up keep it that way, so they're walked through too. writes through references are
+        // never_referenced's problem
+        auto from_minus_one_at = [&](iword_t slot, size_t header) {
+            auto constant_before = [&](size_t t) {
+                return t > func.loc && jumps_to[t].empty() && p[t - 1].kind == IntegerInline && (iwordsigned_t)p[t - 1].n >= -1;
+            };
+            vector<bool> seen(func_end - func.loc, false);
+            vector<size_t> todo;
+            auto preds = [&](size_t t) {
+                for (auto from : jumps_to[t])
+                {
+                    if (from == outside && t != func.loc) return false;
+                    if (from != outside && from >= func.loc && from < func_end) todo.push_back(from);
+                }
+                if (t > func.loc && p[t - 1].kind != Goto && p[t - 1].kind != GotoLabel && p[t - 1].kind != Return) todo.push_back(t - 1);
+                return true;
+            };
+            seen[header - func.loc] = true;
+            if (!preds(header)) return false;
+            while (todo.size())
+            {
+                auto t = vec_pop_back(todo);
+                if (seen[t - func.loc]) continue;
+                seen[t - func.loc] = true;
+                auto & tok = p[t];
+                bool assigned = tok.kind == Assign && t > func.loc && p[t - 1].n == slot &&
+                    (p[t - 1].kind == LocalVarLookup || p[t - 1].kind == LocalVarDecLookup) && jumps_to[t].empty();
+                if (assigned && constant_before(t - 1)) continue;
+                if (tok.kind == AsLocal && tok.n == slot && constant_before(t)) continue;
+                if (tok.kind == LocalVarDec && tok.n == slot) continue;
+                if (assigned || (tok.kind == AsLocal && tok.n == slot) || (tok.kind >= AddAsLocal && tok.kind <= ModAsLocal && tok.n == slot))
+                    return false;
+                if (!preds(t)) return false;
+            }
+            return true;
+        };
+        // whether nothing can be holding a reference to a local, which could later be used to assign something else to it
+        auto never_referenced = [&](iword_t slot) {
+            for (size_t t = func.loc; t < func_end; t++)
+                if ((p[t].kind == LocalVarLookup || p[t].kind == LocalVarDecLookup) && p[t].n == slot &&
+                    !assigns(t, func_end) && !indexes(t, func_end) && !counts_up(t, func_end))
+                    return false;
+            return true;
+        };
+        
+        for (size_t f = func.loc; f < func_end; f++)
+        {
+            if (p[f].kind != ForLoopLocalLen) continue;
+            size_t body = p[f].n;
+            auto counter = p[f].extra_1, array = p[f].extra_2;
+            if (body >= f || body <= func.loc || counter == array) continue;
+            
+            // the body can only be gotten into by this loop token, not by falling into it or by jumping into the middle of it
+            bool ok = p[body - 1].kind == GotoLabel || p[body - 1].kind == Goto;
+            for (size_t t = body; ok && t < f; t++)
+                for (auto from : jumps_to[t])
+                    if (!(from >= body && from < f) && !(t == body && from == f)) ok = false;
+            
+            // and it can't change the counter or the array, or resize anything (which might be the same array under another name)
+            for (size_t t = body; ok && t < f; t++)
+            {
+                auto & tok = p[t];
+                auto kind = tok.kind;
+                bool mine = tok.n == counter || tok.n == array;
+                if (kind == Call || kind == FuncCall || kind == Yield || kind == Resume || kind == FuncDec || kind == Exit ||
+                    kind == CoroEnd || kind == ArrayPushIn || kind == ArrayPopOut || kind == ArrayPushBack || kind == ArrayPopBack ||
+                    kind == ArrayConcat)
+                    ok = false;
+                else if (kind == BuiltinCall && std::find(harmless.begin(), harmless.end(), tok.n) == harmless.end())
+                    ok = false;
+                else if (mine && (kind == AsLocal || (kind >= AddAsLocal && kind <= ModAsLocal) || kind == LocalVarDec || kind == LocalVarDecLookup))
+                    ok = false;
+                else if (mine && kind == LocalVarLookup && !(tok.n == array && indexes(t, f)))
+                    ok = false;
+                else if (is_loop(tok) && (tok.extra_1 == counter || tok.extra_1 == array))
+                    ok = false;
+            }
+            if (!ok || !from_minus_one_at(counter, f) || !never_referenced(counter) || !never_referenced(array)) continue;
+            
+            for (size_t t = body; t + 2 < f; t++)
+            {
+                if (p[t].kind == LocalVar && p[t].n == array && p[t + 1].kind == LocalVar && p[t + 1].n == counter && p[t + 2].kind == ArrayIndex)
+                {
+                    p[t].kind = ArrayIndexUnchecked;
+                    p[t].extra_1 = counter;
+                }
+            }
+        }
+    }
+}
+
 Program load_program(string text)
 {
     size_t line = 0;
@@ -445,7 +1599,7 @@ Program load_program(string text)
         unordered_map<string, int> prec;
         
         #define ADD_PREC(N, X) for (auto & s : X) prec.insert({s, N});
-        ADD_PREC(6, (initializer_list<string>{ "@", "@-", "@--", "@+", "@++", "@@" }));
+        ADD_PREC(6, (initializer_list<string>{ "@", "@-", "@--", "@+", "@++", "@@", "@.." }));
         ADD_PREC(5, (initializer_list<string>{ "*", "/", "%", "<<", ">>", "&" }));
         ADD_PREC(4, (initializer_list<string>{ "+", "-", "|", "^" }));
         ADD_PREC(3, (initializer_list<string>{ "==", "<=", ">=", "!=", ">", "<" }));
@@ -557,6 +1711,7 @@ Program load_program(string text)
     trivial_ops.insert({"@++", ArrayPushBack});
     trivial_ops.insert({"@--", ArrayPopBack});
     trivial_ops.insert({"@@", ArrayConcat});
+    trivial_ops.insert({"@..", ArraySlice});
     
     for (i = 0; i < program_texts.size() && program_texts[i] != ""; i++)
     {
@@ -582,6 +1737,10 @@ Program load_program(string text)
         }
         else if (token == "return")
             p.push_back(make_token(Return, 0));
+        else if (token == "yield")
+            p.push_back(make_token(Yield, 0));
+        else if (token == "resume")
+            p.push_back(make_token(Resume, 0));
         else if (token.front() == '$' && token.back() == '$' && token.size() >= 3)
         {
             auto s = token.substr(1, token.size() - 2);
@@ -699,6 +1858,9 @@ Program load_program(string text)
         }
     }
     p.push_back(make_token(Exit, 0));
+    // coroutines return to here when their function returns (see make_coro). never reached otherwise
+    p.push_back(make_token(CoroEnd, 0));
+    lines.resize(p.size(), lines.size() ? lines.back() : 0);
     
     //for (auto & s : program_texts)
     //    printf("%s\n", s.data());
@@ -719,6 +1881,11 @@ Program load_program(string text)
             p[i].kind = (TKind)(p[i+1].kind + (AddIntInline - Add));
             prog_erase(i-- + 1);
         }
+        if (still_valid() && p[i].kind == IntegerInline && p[i+1].kind == ArrayIndex)
+        {
+            p[i].kind = ArrayIndexConst;
+            prog_erase(i-- + 1);
+        }
         if (still_valid() && p[i].kind == DoubleInline && (p[i+1].kind == Add || p[i+1].kind == Sub ||
             p[i+1].kind == Mul || p[i+1].kind == Div || p[i+1].kind == Mod))
         {
@@ -753,6 +1920,28 @@ Program load_program(string text)
             prog_erase(i + 2);
             prog_erase(i-- + 1);
         }
+        // same thing, for a loop that runs up to the value of another local, e.g. $i n :loopstart inc_goto_until
+        if (still_valid() && i + 2 < p.size() && p[i].kind == LocalVarLookup && p[i+1].kind == LocalVar && p[i+2].kind == ForLoopLabel)
+        {
+            p[i].kind = ForLoopLocalVar;
+            p[i].extra_1 = p[i].n;
+            p[i].extra_2 = p[i+1].n;
+            p[i].n = p[i+2].n;
+            prog_erase(i + 2);
+            prog_erase(i-- + 1);
+        }
+        // same thing, for a loop that runs up to the length of a local array, e.g. $i a @? :loopstart inc_goto_until
+        if (still_valid() && i >= 1 && i + 2 < p.size() && p[i-1].kind == LocalVarLookup && p[i].kind == LocalVar &&
+            p[i+1].kind == ArrayLen && p[i+2].kind == ForLoopLabel)
+        {
+            p[i-1].kind = ForLoopLocalLen;
+            p[i-1].extra_1 = p[i-1].n;
+            p[i-1].extra_2 = p[i].n;
+            p[i-1].n = p[i+2].n;
+            prog_erase(i + 2);
+            prog_erase(i + 1);
+            prog_erase(i--);
+        }
         if (still_valid() && p[i].kind >= CmpEQ && p[i].kind <= CmpGT && p[i+1].kind == IfGotoLabel)
         {
             p[i].kind = TKind(IfGotoLabelEQ + (p[i].kind - CmpEQ));
@@ -802,11 +1991,14 @@ Program load_program(string text)
                     p[i2].kind == MulAsLocal || p[i2].kind == DivAsLocal || p[i2].kind == ModAsLocal)
                     p[i2].n = varnames_set[p[i2].n];
                 
-                if (p[i2].kind == ForLoopLocal)
+                if (p[i2].kind == ForLoopLocal || p[i2].kind == ForLoopLocalLen || p[i2].kind == ForLoopLocalVar)
                     p[i2].extra_1 = varnames_set[p[i2].extra_1];
+                if (p[i2].kind == ForLoopLocalLen || p[i2].kind == ForLoopLocalVar)
+                    p[i2].extra_2 = varnames_set[p[i2].extra_2];
                 
                 if (p[i2].kind == LabelLookup || p[i2].kind == GotoLabel || p[i2].kind == ForLoopLabel ||
-                    p[i2].kind == ForLoopLocal || (p[i2].kind >= IfGotoLabel && p[i2].kind <= IfGotoLabelGT))
+                    p[i2].kind == ForLoopLocal || p[i2].kind == ForLoopLocalLen || p[i2].kind == ForLoopLocalVar ||
+                    (p[i2].kind >= IfGotoLabel && p[i2].kind <= IfGotoLabelGT))
                 {
                     p[i2].n = labels[p[i2].n];
                     if(p[i2].n == (iword_t)-1)
@@ -833,7 +2025,8 @@ Program load_program(string text)
         if (p[i].kind == FuncDec) i += funcs[p[i].n].len;
         
         if (p[i].kind == LabelLookup || p[i].kind == GotoLabel || p[i].kind == ForLoopLabel ||
-            p[i].kind == ForLoopLocal || (p[i].kind >= IfGotoLabel && p[i].kind <= IfGotoLabelGT))
+            p[i].kind == ForLoopLocal || p[i].kind == ForLoopLocalLen || p[i].kind == ForLoopLocalVar ||
+            (p[i].kind >= IfGotoLabel && p[i].kind <= IfGotoLabelGT))
         {
             p[i].n = root_labels[p[i].n];
             if (p[i].n == (iword_t)-1)
@@ -841,6 +2034,9 @@ Program load_program(string text)
         }
     }
     
+    compile_loop_kernels(programdata);
+    compile_unchecked_indexes(programdata);
+    
     // disassembler
     //for (iword_t i = 0; i < p.size(); i++)
     //    printf("%u \t: %s\t%u\t%u\t%u\n", i, tnames[(TKind)p[i].kind], p[i].n, p[i].extra_1, p[i].extra_2);
@@ -848,22 +2044,107 @@ Program load_program(string text)
     return programdata;
 }
 
-struct ProgramState {
-    const Program & programdata;
-    const vector<CompFunc> & funcs;
-    vector<DynamicType> vars_default;
-    vector<iword_t> callstack;
-    
-    ArrayData globals;
-    DynamicType * globals_raw;
-    
-    vector<ArrayData> varstacks;
-    ArrayData varstack;
-    DynamicType * varstack_raw;
+// runs a ForLoopKernel loop's iterations, starting with the one counter is already on, and returns next once the loop is done.
+// anything the kernel doesn't handle the same way the bytecode would (an element that isn't a number, an index past the end,
+// an integer division by zero, ...) hands the rest of that iteration back to the bytecode instead: it returns the token
+// of the statement that it couldn't run, which then also raises whatever error the bytecode would have
+int run_loop_kernel(ProgramState & s, const LoopKernel & k, int64_t & counter, int64_t num, int next)
+{
+    DynamicType * data[LoopKernel::max_arrays];
+    size_t len[LoopKernel::max_arrays];
+    for (size_t a = 0; a < k.arrays.size(); a++)
+    {
+        auto & v = s.varstack_raw[k.arrays[a]];
+        if (!v.is_array()) return k.body;
+        if (k.stored[a]) v.as_array().own();
+    }
+    // owning an array can swap out the items of any other handle to it, so this has to wait until all of them are owned
+    for (size_t a = 0; a < k.arrays.size(); a++)
+    {
+        auto & items = *s.varstack_raw[k.arrays[a]].as_array().items();
+        data[a] = items.data();
+        len[a] = items.size();
+    }
     
-    vector<vector<DynamicType>> evalstacks;
-    vector<DynamicType> evalstack;
-};
+    struct Num { bool dub; int64_t i; double d; };
+    Num stack[LoopKernel::max_depth];
+    while (true)
+    {
+        // one unit of budget per iteration, like the bytecode's backwards jump. the caller's BUDGET_CHECK charges for the last one,
+        // and preempts at the start of the body if there's none left, which is where the bytecode would have stopped too
+        if (s.budget <= 0) return k.body;
+        size_t sp = 0, statement = 0;
+        for (auto & op : k.ops)
+        {
+            switch (op.kind)
+            {
+            case LoopKernel::KLoad:
+            {
+                if ((uint64_t)counter >= len[op.n]) return k.starts[statement];
+                auto & x = data[op.n][counter].value;
+                if (auto xi = std::get_if<int64_t>(&x)) stack[sp++] = {false, *xi, 0.0};
+                else if (auto xd = std::get_if<double>(&x)) stack[sp++] = {true, 0, *xd};
+                else return k.starts[statement];
+                break;
+            }
+            case LoopKernel::KCounter: stack[sp++] = {false, counter, 0.0}; break;
+            case LoopKernel::KLocal:
+            {
+                auto & x = s.varstack_raw[op.n].value;
+                if (auto xi = std::get_if<int64_t>(&x)) stack[sp++] = {false, *xi, 0.0};
+                else if (auto xd = std::get_if<double>(&x)) stack[sp++] = {true, 0, *xd};
+                else return k.starts[statement];
+                break;
+            }
+            case LoopKernel::KInt: stack[sp++] = {false, op.i, 0.0}; break;
+            case LoopKernel::KDouble: stack[sp++] = {true, 0, op.d}; break;
+            case LoopKernel::KNeg:
+            {
+                // like the Neg token, which always gives back an int, even for doubles
+                auto & x = stack[sp - 1];
+                if (x.dub) { x.i = (int64_t)-x.d; x.dub = false; }
+                else x.i = (int64_t)(0 - (uint64_t)x.i);
+                break;
+            }
+            case LoopKernel::KStore:
+            {
+                if ((uint64_t)counter >= len[op.n]) return k.starts[statement];
+                auto & x = data[op.n][counter];
+                // overwriting anything other than a number would run its destructor, which could free the arrays being looped over
+                if (!x.is_int() && !x.is_double()) return k.starts[statement];
+                auto & r = stack[--sp];
+                if (r.dub) x.value = r.d;
+                else x.value = r.i;
+                statement++;
+                break;
+            }
+            default: // arithmetic, with the same int/double rules as DynamicType's operators
+            {
+                auto b = stack[--sp];
+                auto & a = stack[sp - 1];
+                if (!a.dub && !b.dub)
+                {
+                    if ((op.kind == LoopKernel::KDiv || op.kind == LoopKernel::KMod) && (b.i == 0 || b.i == -1))
+                        return k.starts[statement];
+                    // wrapping, like the int64_t arithmetic the bytecode does in practice
+                    uint64_t x = a.i, y = b.i;
+                    a.i = op.kind == LoopKernel::KAdd ? (int64_t)(x + y) : op.kind == LoopKernel::KSub ? (int64_t)(x - y) :
+                          op.kind == LoopKernel::KMul ? (int64_t)(x * y) : op.kind == LoopKernel::KDiv ? a.i / b.i : a.i % b.i;
+                }
+                else
+                {
+                    double x = a.dub ? a.d : (double)a.i, y = b.dub ? b.d : (double)b.i;
+                    a.d = op.kind == LoopKernel::KAdd ? x + y : op.kind == LoopKernel::KSub ? x - y :
+                          op.kind == LoopKernel::KMul ? x * y : op.kind == LoopKernel::KDiv ? x / y : fmod(x, y);
+                    a.dub = true;
+                }
+            }
+            }
+        }
+        if (++counter >= num) return next;
+        s.budget--;
+    }
+}
 
 #if !defined(INTERPRETER_USE_LOOP) && !defined(INTERPRETER_USE_CGOTO)
 typedef void(*[[clang::preserve_none]] HandlerT)(ProgramState & s, int i, const Token * program);
@@ -871,37 +2152,50 @@ struct HandlerInfo { const HandlerT s[HandlerCount]; };
 extern const HandlerInfo handler;
 #endif
 
-int interpreter_core(const Program & programdata, int i)
+int interpreter_core(ProgramState & s, int i)
 {
-    auto program = programdata.program.data();
-    
-    vector<DynamicType> vars_default;
-    for (size_t i = 0; i < programdata.token_varnames.size(); i++) vars_default.push_back(0);
-    
-    auto s = ProgramState {
-        programdata, programdata.funcs, vars_default, {},
-        make_array_data(vars_default), 0, {}, make_array_data(vars_default), 0, {}, {}
-    };
-    
-    s.globals_raw = s.globals->data();
-    s.varstack_raw = s.varstack->data();
+    auto program = s.programdata.program.data();
+    s.preempted_at = -1;
+    #ifdef INTERPRETER_SAMPLE
+    SampleScope sample_scope(s.sample);
+    #endif
+    #ifdef INTERPRETER_ALLOC_STATS
+    AllocScope alloc_scope(s.programdata.lines);
+    #endif
     
     #define valreq(X) if (s.evalstack.size() < X) THROWSTR("internal interpreter error: not enough values on stack");
     #define valpush(X) s.evalstack.push_back(X)
     #define valpop() vec_pop_back(s.evalstack)
     #define valback() vec_at_back(s.evalstack)
     
+    #ifdef INTERPRETER_PROFILE
+    #define PROFILE_COUNT() s.profile.tick(i);
+    #else
+    #define PROFILE_COUNT()
+    #endif
+    #ifdef INTERPRETER_SAMPLE
+    #define SAMPLE_PUBLISH() s.sample.ip = i;
+    #else
+    #define SAMPLE_PUBLISH()
+    #endif
+    #ifdef INTERPRETER_ALLOC_STATS
+    #define ALLOC_PUBLISH() alloc_ip = i;
+    #else
+    #define ALLOC_PUBLISH()
+    #endif
+    #define PROFILE_TICK() PROFILE_COUNT() SAMPLE_PUBLISH() ALLOC_PUBLISH()
+    
     #ifdef INTERPRETER_USE_LOOP
     
     #define INTERPRETER_NEXT()
     #define INTERPRETER_DEF() try { while (1) {\
             auto n = program[i].n;\
             switch (program[i].kind) {
-    #define INTERPRETER_CASE(NAME) case NAME: i += 1; {
+    #define INTERPRETER_CASE(NAME) case NAME: PROFILE_TICK() i += 1; {
     #define INTERPRETER_ENDCASE() } break;
     #define INTERPRETER_ENDDEF() default: THROWSTR("internal interpreter error: unknown opcode"); } } }\
-        catch (const exception& e) { rethrow(s.programdata.lines[i-1], i-1, e); }
-    #define INTERPRETER_DOEXIT() return 0;
+        catch (const exception& e) { s.out.flush(); rethrow(s.programdata.lines[i-1], i-1, e); }
+    #define INTERPRETER_DOEXIT() return s.preempted_at;
     
     #elif defined INTERPRETER_USE_CGOTO
     
@@ -914,21 +2208,21 @@ int interpreter_core(const Program & programdata, int i)
     
     #define INTERPRETER_CASE(NAME)\
         { Handler##NAME: \
-        auto n = program[i++].n; (void)n; {
+        PROFILE_TICK() auto n = program[i++].n; (void)n; {
         //printf("at %d in %s\n", i - 1, #NAME);
     #define INTERPRETER_ENDCASE() } INTERPRETER_NEXT() }
-    #define INTERPRETER_ENDDEF() INTERPRETER_EXIT: { } return 0; }\
-        catch (const exception& e) { rethrow(s.programdata.lines[i-1], i-1, e); }
+    #define INTERPRETER_ENDDEF() INTERPRETER_EXIT: { } return s.preempted_at; }\
+        catch (const exception& e) { s.out.flush(); rethrow(s.programdata.lines[i-1], i-1, e); }
     #define INTERPRETER_DOEXIT() goto INTERPRETER_EXIT;
     
     #else // of ifdef INTERPRETER_USE_LOOP
     
     #define INTERPRETER_NEXT() { [[clang::musttail]] return handler.s[program[i].kind](s, i, program); }
-    #define INTERPRETER_DEF() { handler.s[program[i].kind](s, i, program); return 0; } }
+    #define INTERPRETER_DEF() { try { handler.s[program[i].kind](s, i, program); } catch (...) { s.out.flush(); throw; } return s.preempted_at; } }
     
     #define INTERPRETER_CASE(NAME)\
         extern "C" [[clang::preserve_none]] void Handler##NAME(ProgramState & s, int i, const Token * program) { \
-        auto n = program[i++].n; (void)n; try {
+        PROFILE_TICK() auto n = program[i++].n; (void)n; try {
         //printf("at %d in %s\n", i - 1, #NAME);
     #define INTERPRETER_ENDCASE() } catch (const exception& e) { rethrow(s.programdata.lines[i-1], i-1, e); }\
         INTERPRETER_NEXT() }
@@ -939,6 +2233,9 @@ int interpreter_core(const Program & programdata, int i)
     
     #define INTERPRETER_MIDCASE(NAME) INTERPRETER_ENDCASE() INTERPRETER_CASE(NAME)
     
+    // only done on taken jumps and on calls, so that any loop eventually hits it
+    #define BUDGET_CHECK() if (__builtin_expect(--s.budget < 0, 0)) { s.preempted_at = i; INTERPRETER_DOEXIT(); }
+    
     INTERPRETER_DEF()
     
     INTERPRETER_CASE(FuncDec)
@@ -979,11 +2276,12 @@ int interpreter_core(const Program & programdata, int i)
         THROWSTR("internal interpreter error: tried to execute opcode that's supposed to be deleted");
         
     #define DO_FCALL()\
-        s.callstack.push_back(i);\
+        SAMPLE_GUARDED(s.callstack.push_back(i))\
         i = f.loc;\
         s.varstacks.push_back(std::move(s.varstack));\
-        s.varstack = make_array_data(vector(f.varcount, DynamicType(0)));\
-        s.varstack_raw = s.varstack->data();
+        s.varstack = make_array_data(vector(f.varcount, DynamicType(0)), AllocFrame);\
+        s.varstack_raw = s.varstack->data();\
+        BUDGET_CHECK()
     
     INTERPRETER_MIDCASE(Call)
         Func f = valpop().as_func();
@@ -1009,9 +2307,9 @@ int interpreter_core(const Program & programdata, int i)
     
     INTERPRETER_MIDCASE(IfGoto) valreq(2);
         Label dest = valpop().as_label();
-        if (valpop()) i = dest.loc;
+        if (valpop()) { i = dest.loc; BUDGET_CHECK() }
     INTERPRETER_MIDCASE(IfGotoLabel)
-        if (valpop()) i = n;
+        if (valpop()) { i = n; BUDGET_CHECK() }
     
     INTERPRETER_MIDCASE(ForLoop) valreq(3);
         Label dest = valpop().as_label();
@@ -1020,7 +2318,7 @@ int interpreter_core(const Program & programdata, int i)
         if (!num.is_int() || !ref.ref()->is_int())
             THROWSTR("Tried to use for loop with non-integer");
         *ref.ref() = *ref.ref() + 1;
-        if (*ref.ref() < num) i = dest.loc;
+        if (*ref.ref() < num) { i = dest.loc; BUDGET_CHECK() }
         
     INTERPRETER_MIDCASE(ForLoopLabel) valreq(2);
         auto num = valpop();
@@ -1028,7 +2326,7 @@ int interpreter_core(const Program & programdata, int i)
         if (!num.is_int() || !ref.ref()->is_int())
             THROWSTR("Tried to use for loop with non-integer");
         *ref.ref() = *ref.ref() + 1;
-        if (*ref.ref() < num) i = n;
+        if (*ref.ref() < num) { i = n; BUDGET_CHECK() }
         
     INTERPRETER_MIDCASE(ForLoopLocal)
         // FIXME: add a global version
@@ -1037,14 +2335,52 @@ int interpreter_core(const Program & programdata, int i)
             THROWSTR("Tried to use for loop with non-integer");
         auto & v = _v.as_int();
         int64_t num = (iwordsigned_t)program[i-1].extra_2;
-        if (++v < num) i = n;
+        if (++v < num) { i = n; BUDGET_CHECK() }
+    
+    // ForLoopLocal, ForLoopLocalLen or ForLoopLocalVar with a body that run_loop_kernel runs natively. n is the LoopKernel
+    INTERPRETER_MIDCASE(ForLoopKernel)
+        auto & k = s.programdata.loop_kernels[n];
+        auto extra_2 = program[i-1].extra_2;
+        int64_t num = (iwordsigned_t)extra_2;
+        if (k.bound == LoopKernel::BoundLen)
+            num = s.varstack_raw[extra_2].as_array_ptr_thru_ref()->items()->size();
+        else if (k.bound == LoopKernel::BoundLocal)
+        {
+            if (!s.varstack_raw[extra_2].is_int())
+                THROWSTR("Tried to use for loop with non-integer");
+            num = s.varstack_raw[extra_2].as_int();
+        }
+        auto & _v = s.varstack_raw[program[i-1].extra_1];
+        if (!_v.is_int())
+            THROWSTR("Tried to use for loop with non-integer");
+        auto & v = _v.as_int();
+        if (++v < num) { i = run_loop_kernel(s, k, v, num, i); BUDGET_CHECK() }
+    
+    // ForLoopLocal up to the length of a local array. extra_2 is the array
+    INTERPRETER_MIDCASE(ForLoopLocalLen)
+        int64_t num = s.varstack_raw[program[i-1].extra_2].as_array_ptr_thru_ref()->items()->size();
+        auto & _v = s.varstack_raw[program[i-1].extra_1];
+        if (!_v.is_int())
+            THROWSTR("Tried to use for loop with non-integer");
+        auto & v = _v.as_int();
+        if (++v < num) { i = n; BUDGET_CHECK() }
+    
+    // ForLoopLocal up to the value of another local. extra_2 is that local
+    INTERPRETER_MIDCASE(ForLoopLocalVar)
+        auto & _num = s.varstack_raw[program[i-1].extra_2];
+        auto & _v = s.varstack_raw[program[i-1].extra_1];
+        if (!_num.is_int() || !_v.is_int())
+            THROWSTR("Tried to use for loop with non-integer");
+        int64_t num = _num.as_int();
+        auto & v = _v.as_int();
+        if (++v < num) { i = n; BUDGET_CHECK() }
     
     // INTERPRETER_MIDCASE_GOTOLABELCMP
     #define IMGLC(X, OP) \
     INTERPRETER_MIDCASE(IfGotoLabel##X) valreq(2);\
         auto val2 = valpop();\
         auto val1 = valpop();\
-        if (val1 OP val2) i = n;
+        if (val1 OP val2) { i = n; BUDGET_CHECK() }
     
     // INTERPRETER_MIDCASE_BINARY_SIMPLE
     #define IMCBS(NAME, OP) \
@@ -1096,8 +2432,8 @@ int interpreter_core(const Program & programdata, int i)
     #define IMCU(NAME, OP) INTERPRETER_MIDCASE(NAME) valback() = OP valback();
     IMCU(Neg, -) IMCU(BoolNot, !) IMCU(BitNot, ~)
     
-    INTERPRETER_MIDCASE(Goto) i = valpop().as_label().loc;
-    INTERPRETER_MIDCASE(GotoLabel) i = n;
+    INTERPRETER_MIDCASE(Goto) i = valpop().as_label().loc; BUDGET_CHECK()
+    INTERPRETER_MIDCASE(GotoLabel) i = n; BUDGET_CHECK()
     
     INTERPRETER_MIDCASE(IntegerInline) valpush((int64_t)(iwordsigned_t)n);
     INTERPRETER_MIDCASE(IntegerInlineBigDec) valpush(((int64_t)(iwordsigned_t)n)*10000);
@@ -1117,16 +2453,40 @@ int interpreter_core(const Program & programdata, int i)
     INTERPRETER_MIDCASE(ArrayBuild)
         auto back = std::move(s.evalstack);
         s.evalstack = vec_pop_back(s.evalstacks);
-        valpush(make_array(make_array_data(std::move(back))));
+        valpush(make_array(make_literal_array_data(std::move(back))));
     
-    INTERPRETER_MIDCASE(ArrayEmptyLit) valpush(make_array(make_array_data()));
+    INTERPRETER_MIDCASE(ArrayEmptyLit) valpush(make_array(make_array_data_with_room(0)));
     
     INTERPRETER_MIDCASE(ArrayIndex) valreq(2);
         auto n = valpop().as_into_int();
         auto & val = valback();
         auto a = val.as_array_ptr_thru_ref();
-        if (val.is_array()) val = (*a->items()).at(n);
-        else val = make_ref(a->items(), (size_t)n);
+        // copy out first: the element is owned by val, which the assignment destroys
+        if (val.is_array()) val = DynamicType((*a->items()).at(n));
+        else { a->own(); val = make_element_ref(*a, (size_t)n); }
+    
+    // array index that was a constant, e.g. the 4 in heap @ 4
+    INTERPRETER_MIDCASE(ArrayIndexConst) valreq(1);
+        auto & val = valback();
+        auto a = val.as_array_ptr_thru_ref();
+        auto k = (size_t)(int64_t)(iwordsigned_t)n;
+        if (val.is_array()) val = DynamicType((*a->items()).at(k));
+        else { a->own(); val = make_element_ref(*a, k); }
+    
+    // LocalVar a, LocalVar i, ArrayIndex, where compile_unchecked_indexes proved that i is an int and 0 <= i < a @?.
+    // n is a and extra_1 is i. leaves the other two tokens in place, and skips over them
+    INTERPRETER_MIDCASE(ArrayIndexUnchecked)
+        auto & val = s.varstack_raw[n];
+        auto k = (size_t)*std::get_if<int64_t>(&s.varstack_raw[program[i-1].extra_1].value);
+        if (val.is_array()) valpush(val.as_array().items()->data()[k]);
+        else
+        {
+            // a reference to an array, which could have been pointed somewhere else since the loop checked it
+            auto a = val.as_array_ptr_thru_ref();
+            a->own();
+            valpush(make_element_ref(*a, k));
+        }
+        i += 2;
     
     INTERPRETER_MIDCASE(Clone) valpush(valpop().clone(false));
     INTERPRETER_MIDCASE(CloneDeep) valpush(valpop().clone(true));
@@ -1147,6 +2507,7 @@ int interpreter_core(const Program & programdata, int i)
         a->dirtify();
         if (a->items()->size() < n) THROWSTR("tried to access past end of array");
         a->items()->insert(a->items()->begin() + n, std::move(inval));
+        ALLOC_RESIZED(a->items(), AllocGrow)
     
     INTERPRETER_MIDCASE(ArrayPopOut) valreq(2);
         uint64_t n = valpop().as_into_int();
@@ -1164,6 +2525,7 @@ int interpreter_core(const Program & programdata, int i)
         Array * a = v.as_array_ptr_thru_ref();
         a->dirtify();
         a->items()->push_back(inval);
+        ALLOC_RESIZED(a->items(), AllocGrow)
     
     INTERPRETER_MIDCASE(ArrayPopBack)
         auto & v = valback();
@@ -1175,21 +2537,38 @@ int interpreter_core(const Program & programdata, int i)
         auto vr = valpop();
         Array * ar = vr.as_array_ptr_thru_ref();
         auto & vl = valback();
-        Array * al = vl.as_array_ptr_thru_ref();
-        auto newarray = make_array(make_array_data());
-        
-        newarray.items()->insert(newarray.items()->end(), al->items()->begin(), al->items()->end());
-        newarray.items()->insert(newarray.items()->end(), ar->items()->begin(), ar->items()->end());
-        vl = std::move(newarray);
+        // a left side that nothing else can see (e.g. the result of another @@) gets appended to instead of copied
+        if (vl.is_array() && array_is_unique(vl.as_array()))
+        {
+            Array * al = &vl.as_array();
+            al->items()->insert(al->items()->end(), ar->items()->begin(), ar->items()->end());
+            ALLOC_RESIZED(al->items(), AllocConcat)
+        }
+        else
+        {
+            Array * al = vl.as_array_ptr_thru_ref();
+            auto newarray = make_array(make_array_data_with_room(al->items()->size() + ar->items()->size(), AllocConcat));
+            
+            newarray.items()->insert(newarray.items()->end(), al->items()->begin(), al->items()->end());
+            newarray.items()->insert(newarray.items()->end(), ar->items()->begin(), ar->items()->end());
+            ALLOC_RESIZED(newarray.items(), AllocConcat)
+            vl = std::move(newarray);
+        }
+    
+    INTERPRETER_MIDCASE(ArraySlice) valreq(3);
+        uint64_t len = valpop().as_into_int();
+        uint64_t start = valpop().as_into_int();
+        auto & v = valback();
+        v = array_slice(*v.as_array_ptr_thru_ref(), start, len);
     
     INTERPRETER_MIDCASE(StringLiteral)
         valpush(make_array(make_array_data(s.programdata.get_token_stringval(n))));
     
     INTERPRETER_MIDCASE(StringLitReference)
-        valpush(make_array(s.programdata.get_token_stringref(n)));
+        valpush(make_array(s.get_stringref(n)));
     
     INTERPRETER_MIDCASE(BuiltinCall)
-        builtins[n](s.evalstack);
+        builtins[n](s, s.evalstack);
     
     INTERPRETER_MIDCASE(Punt)
         if (s.evalstacks.size() == 0) THROWSTR("Tried to punt when only one evaluation stack was open");
@@ -1203,6 +2582,25 @@ int interpreter_core(const Program & programdata, int i)
         for (size_t n = 0; n < count; n++) b.push_back(std::move(*(s.evalstack.end()-1-n)));
         s.evalstack.erase(s.evalstack.end()-count, s.evalstack.end());
     
+    // val coro resume: switches to the coroutine, pushing val onto its stack (as an argument the first time,
+    // as the result of its yield after that). pushes whatever it yields next, or the value it returns once it's done
+    INTERPRETER_MIDCASE(Resume) valreq(2);
+        Coro c = valpop().as_coro();
+        auto v = valpop();
+        i = coro_resume(s, c, i);
+        valpush(std::move(v));
+    
+    INTERPRETER_MIDCASE(Yield)
+        auto v = valpop();
+        i = coro_suspend(s, i);
+        valpush(std::move(v));
+    
+    INTERPRETER_MIDCASE(CoroEnd)
+        auto v = s.evalstack.size() ? valpop() : DynamicType(0);
+        s.coro.p->done = true;
+        i = coro_suspend(s, i);
+        valpush(std::move(v));
+    
     INTERPRETER_MIDCASE(Exit)
         INTERPRETER_DOEXIT();
         
@@ -1216,10 +2614,134 @@ const HandlerInfo handler = { TOKEN_TABLE };
 #undef PFX
 #endif
 
-int interpret(const Program & programdata)
+// runs a function from native code, e.g. from inside of a builtin, and returns once it returns
+// its arguments have to already be on the eval stack, and its return values are left there
+// if frame is given, it's used as the function's local variable storage and kept around for the next call,
+// unless something held on to a reference into it, in which case a new one gets made
+// puts back everything call_func changed, including, if the function threw, whatever stacks it left pushed,
+// so that the native caller (or a VM, for its next call) carries on from the state it called from
+struct CallFuncRestore {
+    ProgramState & s;
+    CoroData * coro = s.coro.p;
+    size_t callstack_size = s.callstack.size();
+    size_t varstacks_size = s.varstacks.size();
+    size_t evalstacks_size = s.evalstacks.size();
+    int native_depth = s.native_depth;
+    int64_t budget = s.budget;
+    ~CallFuncRestore()
+    {
+        coro_unwind(s, coro);
+        if (s.callstack.size() > callstack_size) SAMPLE_GUARDED(s.callstack.resize(callstack_size))
+        if (s.varstacks.size() > varstacks_size)
+        {
+            s.varstack = std::move(s.varstacks[varstacks_size]);
+            s.varstack_raw = s.varstack->data();
+            s.varstacks.resize(varstacks_size);
+        }
+        if (s.evalstacks.size() > evalstacks_size)
+        {
+            s.evalstack = std::move(s.evalstacks[evalstacks_size]);
+            s.evalstacks.resize(evalstacks_size);
+        }
+        s.native_depth = native_depth;
+        s.budget = budget;
+    }
+};
+void call_func(ProgramState & s, Func f, ArrayData * frame)
 {
-    interpreter_core(programdata, 0);
+    CallFuncRestore restore{s};
+    SAMPLE_GUARDED(s.callstack.push_back(s.programdata.program.size() - 2)) // the trailing Exit
+    s.varstacks.push_back(std::move(s.varstack));
+    if (frame && *frame && frame->unique() && (*frame)->size() == f.varcount)
+        for (auto & x : **frame) x = 0;
+    else if (frame)
+        *frame = make_array_data(vector(f.varcount, DynamicType(0)), AllocFrame);
+    s.varstack = frame ? *frame : make_array_data(vector(f.varcount, DynamicType(0)), AllocFrame);
+    s.varstack_raw = s.varstack->data();
+    s.native_depth += 1;
+    // the native caller can't be paused halfway through, so neither can this
+    s.budget = INT64_MAX;
+    interpreter_core(s, f.loc);
+}
+
+int interpret(const Program & programdata, OutputSink sink = stdout_sink(), InputSource source = stdin_source())
+{
+    ProgramState s(programdata, sink, source);
+    #ifdef INTERPRETER_SAMPLE
+    Sampler::Session sampling(programdata);
+    #endif
+    interpreter_core(s, 0);
+    #ifdef INTERPRETER_PROFILE
+    s.out.flush();
+    s.profile.report(programdata, stderr);
+    s.profile.write_json(programdata, INTERPRETER_PROFILE_JSON);
+    #endif
+    #ifdef INTERPRETER_ALLOC_STATS
+    s.out.flush();
+    alloc_stats_report(stderr);
+    #endif
     return 0;
 }
 
+struct Snapshot;
+
+// a program that stays loaded: its top level runs once, when the VM is made, and then the host can call its functions
+// as many times as it wants. globals keep their values between calls, and each function's frame gets reused
+struct VM {
+    ProgramState s;
+    unordered_map<iword_t, ArrayData> frames;
+    
+    VM(const Program & programdata, OutputSink sink = stdout_sink(), InputSource source = stdin_source()) : s(programdata, sink, source)
+    {
+        interpreter_core(s, 0);
+        s.evalstack.clear();
+    }
+    // starts from the globals in a snapshot (see snapshot.hpp) instead of running the top level
+    VM(const Program & programdata, const Snapshot & snap, OutputSink sink = stdout_sink(), InputSource source = stdin_source());
+    
+    Func get_func(const string & name)
+    {
+        auto & names = s.programdata.token_funcs;
+        for (size_t n = 0; n < names.size(); n++)
+        {
+            if (names[n] == name && s.funcs[n].len != 0) return Func{s.funcs[n].loc, s.funcs[n].varcount};
+        }
+        THROWSTR("Unknown function: " + name);
+    }
+    
+    // pushes args, runs f, and moves whatever it returned into results (which gets cleared first)
+    void call(Func f, const vector<DynamicType> & args, vector<DynamicType> & results)
+    {
+        results.clear();
+        try
+        {
+            for (auto & arg : args) s.evalstack.push_back(arg);
+            call_func(s, f, &frames[f.loc]);
+        }
+        catch (...)
+        {
+            // whatever was running is gone, so start the next call from clean stacks; the globals are kept
+            coro_unwind(s, nullptr);
+            s.callstack.clear();
+            s.varstacks.clear();
+            s.varstack = make_array_data(s.vars_default, AllocFrame);
+            s.varstack_raw = s.varstack->data();
+            s.evalstacks.clear();
+            s.evalstack.clear();
+            s.coro = nullptr;
+            s.native_depth = 0;
+            throw;
+        }
+        for (auto & x : s.evalstack) results.push_back(std::move(x));
+        s.evalstack.clear();
+        s.out.flush();
+    }
+    vector<DynamicType> call(const string & name, const vector<DynamicType> & args = {})
+    {
+        vector<DynamicType> results;
+        call(get_func(name), args, results);
+        return results;
+    }
+};
+
 #endif // FLINCH_INCLUDE
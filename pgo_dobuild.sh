@@ -0,0 +1,60 @@
+#!/usr/bin/env sh
+
+# profile-guided builds of every dispatch mode, with and without mimalloc.
+# for each combination: build an instrumented interpreter, train it on examples/*.fl, merge the profile, rebuild main.cpp and
+# bench/bench.cpp with it, and run the benchmark workloads. prints which combination was fastest on each workload.
+# outputs go into pgo/: flinch_<combination> is the optimized interpreter, <combination>.json the benchmark results.
+# usage: ./pgo_dobuild.sh [bench runs, default 5]. set SKIP_MIMALLOC=1 if mimalloc isn't installed
+
+set -e
+
+RUNS=${1:-5}
+FLAGS="-g -ggdb -Wall -Wextra -pedantic -Wno-attributes -pthread -O3 -frandom-seed=constant_seed -fuse-ld=lld -flto -mllvm -inline-threshold=10000"
+OUT=pgo
+
+mkdir -p $OUT
+rm -f $OUT/*.json
+
+for MODE in tailcall INTERPRETER_USE_LOOP INTERPRETER_USE_CGOTO; do
+    for ALLOC in system mimalloc; do
+        if [ "$ALLOC" = mimalloc ] && [ -n "$SKIP_MIMALLOC" ]; then continue; fi
+
+        NAME=${MODE}_${ALLOC}
+        DEFS=""
+        LIBS=""
+        if [ "$MODE" != tailcall ]; then DEFS="-D$MODE"; fi
+        if [ "$ALLOC" = mimalloc ]; then DEFS="$DEFS -DUSE_MIMALLOC"; LIBS="-lmimalloc"; fi
+        RAW=$OUT/raw_$NAME
+        PROFILE=$OUT/$NAME.profdata
+
+        echo "== $NAME: instrumented build"
+        rm -rf $RAW
+        clang++ $FLAGS $DEFS main.cpp -fprofile-generate=$RAW $LIBS -o $OUT/instrumented_$NAME
+
+        echo "== $NAME: training"
+        for F in examples/*.fl; do
+            ./$OUT/instrumented_$NAME $F < /dev/null > /dev/null 2>&1 || echo "   ($F failed, skipping it)"
+        done
+        llvm-profdata merge -output=$PROFILE $RAW/*.profraw
+
+        echo "== $NAME: optimized build"
+        clang++ $FLAGS $DEFS main.cpp -fprofile-use=$PROFILE $LIBS -o $OUT/flinch_$NAME
+        # the profile comes from main.cpp, so bench.cpp's own functions have none
+        clang++ $FLAGS $DEFS bench/bench.cpp -fprofile-use=$PROFILE -Wno-profile-instr-unprofiled -Wno-profile-instr-out-of-date $LIBS -o $OUT/bench_$NAME
+
+        echo "== $NAME: benchmarking"
+        ./$OUT/bench_$NAME --root . --runs $RUNS --no-micro --json $OUT/$NAME.json
+
+        rm -rf $RAW $OUT/instrumented_$NAME
+    done
+done
+
+# bench writes one result per line, like: {"name": "pf", "load_ms": 0.1, "run_ms": 300.0}
+echo
+echo "== fastest run time per workload"
+for J in $OUT/*.json; do
+    NAME=$(basename $J .json)
+    grep '"run_ms"' $J | sed 's/.*"name": "\([^"]*\)".*"run_ms": \([0-9.]*\).*/\1 \2/' | sed "s/\$/ $NAME/"
+done | sort -k1,1 -k2,2g | awk '
+    $1 != last { if (last != "") print ""; printf "%-24s %-40s %10.3f ms  (fastest)\n", $1, $3, $2; last = $1; next }
+    { printf "%-24s %-40s %10.3f ms\n", "", $3, $2 }'
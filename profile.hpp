@@ -0,0 +1,292 @@
+#ifndef FLINCH_PROFILE_INCLUDE
+#define FLINCH_PROFILE_INCLUDE
+
+// two profilers, each compiled in with its own flag.
+// exact profiler, compiled in with INTERPRETER_PROFILE. every handler ticks it on entry, which counts the token and
+// charges the time since the previous tick to the previous token. the totals get broken down by opcode, function and line.
+// the ticking itself costs time too, so small, hot opcodes look more expensive than they really are
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+inline uint64_t profile_clock() { return __rdtsc(); }
+#define PROFILE_CLOCK_UNIT "cycles"
+#else
+#include <chrono>
+inline uint64_t profile_clock() { return std::chrono::steady_clock::now().time_since_epoch().count(); }
+#define PROFILE_CLOCK_UNIT "ticks"
+#endif
+
+#ifndef INTERPRETER_PROFILE_JSON
+#define INTERPRETER_PROFILE_JSON "flinch_profile.json"
+#endif
+
+// the name of the function each token belongs to, or "<top level>"
+inline vector<string> token_owners(const Program & programdata)
+{
+    auto & p = programdata.program;
+    vector<string> owner(p.size(), "<top level>");
+    for (size_t f = 0; f < programdata.funcs.size(); f++)
+    {
+        auto & cf = programdata.funcs[f];
+        for (size_t i = cf.loc; cf.len && i < cf.loc + cf.len && i < p.size(); i++) owner[i] = programdata.token_funcs[f];
+    }
+    return owner;
+}
+
+struct Profile {
+    // per token index
+    vector<uint64_t> counts;
+    vector<uint64_t> cycles;
+    int last = -1;
+    uint64_t last_time = 0;
+
+    Profile(size_t size) : counts(size), cycles(size) { }
+
+    inline void tick(int i)
+    {
+        auto now = profile_clock();
+        if (last >= 0) cycles[last] += now - last_time;
+        counts[i] += 1;
+        last = i;
+        last_time = now;
+    }
+    // charges whatever ran after the last tick, so that it isn't lost when reporting
+    void settle()
+    {
+        auto now = profile_clock();
+        if (last >= 0) cycles[last] += now - last_time;
+        last = -1;
+    }
+
+    // adds in the numbers from another state's profile, e.g. a parallel_for worker's
+    void merge(Profile & other)
+    {
+        other.settle();
+        for (size_t i = 0; i < counts.size() && i < other.counts.size(); i++)
+        {
+            counts[i] += other.counts[i];
+            cycles[i] += other.cycles[i];
+        }
+    }
+
+    struct Row { string name; uint64_t count, cycles; };
+
+    // folds the per-token numbers into rows by the given key, most expensive first
+    template<typename F>
+    vector<Row> rows(F key)
+    {
+        unordered_map<string, size_t> index;
+        vector<Row> ret;
+        for (size_t i = 0; i < counts.size(); i++)
+        {
+            if (!counts[i] && !cycles[i]) continue;
+            auto name = key(i);
+            if (!index.count(name)) { index[name] = ret.size(); ret.push_back({name, 0, 0}); }
+            ret[index[name]].count += counts[i];
+            ret[index[name]].cycles += cycles[i];
+        }
+        std::sort(ret.begin(), ret.end(), [](auto & a, auto & b) { return a.cycles > b.cycles; });
+        return ret;
+    }
+
+    void tables(const Program & programdata, vector<Row> & by_op, vector<Row> & by_func, vector<Row> & by_line)
+    {
+        settle();
+        auto & p = programdata.program;
+        auto owner = token_owners(programdata);
+        auto line = [&](size_t i) { return i < programdata.lines.size() ? programdata.lines[i] : 0; };
+        by_op = rows([&](size_t i) { return string(tnames[p[i].kind]); });
+        by_func = rows([&](size_t i) { return owner[i]; });
+        by_line = rows([&](size_t i) { return std::to_string(line(i)); });
+    }
+
+    void report(const Program & programdata, FILE * f, size_t top = 20)
+    {
+        vector<Row> tables_[3];
+        tables(programdata, tables_[0], tables_[1], tables_[2]);
+        const char * titles[] = { "opcode", "function", "line" };
+        uint64_t total = 0;
+        for (auto & r : tables_[0]) total += r.cycles;
+        for (int t = 0; t < 3; t++)
+        {
+            fprintf(f, "\n%-24s %14s %16s %7s\n", titles[t], "count", PROFILE_CLOCK_UNIT, "%");
+            for (size_t i = 0; i < tables_[t].size() && i < top; i++)
+            {
+                auto & r = tables_[t][i];
+                fprintf(f, "%-24s %14llu %16llu %6.2f%%\n", r.name.data(), (unsigned long long)r.count,
+                    (unsigned long long)r.cycles, total ? 100.0 * r.cycles / total : 0.0);
+            }
+        }
+    }
+
+    static string json_escape(const string & s)
+    {
+        string ret;
+        for (char c : s)
+        {
+            if (c == '"' || c == '\\') ret += '\\';
+            if ((unsigned char)c < 0x20) { char buf[8]; snprintf(buf, sizeof(buf), "\\u%04x", c); ret += buf; }
+            else ret += c;
+        }
+        return ret;
+    }
+    void write_json(const Program & programdata, const string & filename)
+    {
+        vector<Row> tables_[3];
+        tables(programdata, tables_[0], tables_[1], tables_[2]);
+        const char * titles[] = { "opcodes", "functions", "lines" };
+        auto f = fopen(filename.data(), "wb");
+        if (!f) THROWSTR("Failed to open profile output file " + filename);
+        fprintf(f, "{\n  \"unit\": \"%s\"", PROFILE_CLOCK_UNIT);
+        for (int t = 0; t < 3; t++)
+        {
+            fprintf(f, ",\n  \"%s\": [", titles[t]);
+            for (size_t i = 0; i < tables_[t].size(); i++)
+            {
+                auto & r = tables_[t][i];
+                fprintf(f, "%s\n    {\"name\": \"%s\", \"count\": %llu, \"%s\": %llu}", i ? "," : "", json_escape(r.name).data(),
+                    (unsigned long long)r.count, PROFILE_CLOCK_UNIT, (unsigned long long)r.cycles);
+            }
+            fprintf(f, "\n  ]");
+        }
+        fprintf(f, "\n}\n");
+        fclose(f);
+    }
+};
+
+#ifdef INTERPRETER_SAMPLE
+
+#include <atomic>
+#include <csignal>
+#include <map>
+#include <sys/time.h>
+
+#ifndef INTERPRETER_SAMPLE_HZ
+#define INTERPRETER_SAMPLE_HZ 997
+#endif
+#ifndef INTERPRETER_SAMPLE_OUTPUT
+#define INTERPRETER_SAMPLE_OUTPUT "flinch_samples.folded"
+#endif
+
+// sampling profiler, compiled in with INTERPRETER_SAMPLE. every handler publishes its token index into its state's
+// SamplePoint (a single store), and a SIGPROF timer copies that and the call stack into a preallocated buffer.
+// the call stack is only read while it isn't being grown or swapped out (busy), so the signal handler never sees it half-updated.
+// output is in the collapsed stack format that flamegraph.pl and similar tools take
+struct SamplePoint {
+    volatile sig_atomic_t ip = -1;
+    volatile sig_atomic_t busy = 0;
+    const vector<iword_t> * callstack = nullptr;
+};
+
+// the SamplePoint of whatever state the interpreter is running on this thread, if any
+inline thread_local SamplePoint * sample_point = nullptr;
+
+// sets sample_point for the duration of one interpreter_core call
+struct SampleScope {
+    SamplePoint * prev;
+    sig_atomic_t prev_ip;
+    SampleScope(SamplePoint & p) : prev(sample_point), prev_ip(p.ip) { sample_point = &p; }
+    ~SampleScope() { sample_point->ip = prev_ip; sample_point = prev; }
+};
+
+struct Sampler {
+    static constexpr int max_depth = 32;
+    // token indexes, innermost first: the running token, then return addresses. depth 0 means it wasn't in the interpreter
+    struct Sample { int depth; iword_t frames[max_depth]; };
+    
+    static inline vector<Sample> samples;
+    static inline std::atomic<size_t> taken = 0;
+    static inline struct sigaction old_action;
+    
+    static void handler(int)
+    {
+        size_t k = taken.fetch_add(1, std::memory_order_relaxed);
+        if (k >= samples.size()) return;
+        auto & out = samples[k];
+        auto p = sample_point;
+        out.depth = 0;
+        if (!p || p->ip < 0) return;
+        out.frames[out.depth++] = p->ip;
+        if (p->busy || !p->callstack) return;
+        auto & cs = *p->callstack;
+        for (size_t j = cs.size(); j > 0 && out.depth < max_depth; j--)
+            out.frames[out.depth++] = cs[j - 1];
+    }
+    
+    static void start(int hz = INTERPRETER_SAMPLE_HZ, size_t capacity = 1 << 16)
+    {
+        samples.assign(capacity, Sample{});
+        taken = 0;
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = handler;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SIGPROF, &action, &old_action) != 0) THROWSTR("Failed to install the SIGPROF handler");
+        struct itimerval timer;
+        timer.it_interval.tv_sec = 0;
+        timer.it_interval.tv_usec = std::max(1, 1000000 / hz);
+        timer.it_value = timer.it_interval;
+        setitimer(ITIMER_PROF, &timer, nullptr);
+    }
+    static void stop()
+    {
+        struct itimerval timer;
+        memset(&timer, 0, sizeof(timer));
+        setitimer(ITIMER_PROF, &timer, nullptr);
+        sigaction(SIGPROF, &old_action, nullptr);
+    }
+    
+    // one line per distinct stack, outermost frame first, each frame being function:line
+    static void write_collapsed(const Program & programdata, FILE * f)
+    {
+        auto & p = programdata.program;
+        auto owner = token_owners(programdata);
+        auto frame = [&](size_t i) {
+            return owner[i] + ":" + std::to_string(i < programdata.lines.size() ? programdata.lines[i] : 0);
+        };
+        std::map<string, size_t> stacks;
+        size_t n = std::min((size_t)taken, samples.size());
+        for (size_t k = 0; k < n; k++)
+        {
+            auto & sample = samples[k];
+            string stack = sample.depth ? "" : "<outside interpreter>";
+            for (int d = sample.depth - 1; d >= 0; d--)
+            {
+                size_t i = sample.frames[d];
+                if (d > 0)
+                {
+                    // the Exit and CoroEnd that native calls and coroutines return to aren't real frames
+                    if (i + 2 >= p.size()) continue;
+                    i -= 1; // return addresses point just past the call
+                }
+                if (i >= p.size()) continue;
+                stack += (stack.size() ? ";" : "") + frame(i);
+            }
+            stacks[stack] += 1;
+        }
+        for (auto & [stack, count] : stacks)
+            fprintf(f, "%s %zu\n", stack.data(), count);
+        if (taken > samples.size())
+            fprintf(stderr, "sampling profiler: buffer full, dropped %zu samples\n", (size_t)taken - samples.size());
+    }
+    
+    // samples for as long as it's alive, then writes out what it got
+    struct Session {
+        const Program & programdata;
+        string filename;
+        Session(const Program & programdata, string filename = INTERPRETER_SAMPLE_OUTPUT) : programdata(programdata), filename(filename) { start(); }
+        ~Session()
+        {
+            stop();
+            auto f = fopen(filename.data(), "wb");
+            if (!f) { fprintf(stderr, "sampling profiler: failed to open %s\n", filename.data()); return; }
+            write_collapsed(programdata, f);
+            fclose(f);
+        }
+    };
+};
+
+#endif // INTERPRETER_SAMPLE
+
+#endif // FLINCH_PROFILE_INCLUDE
@@ -0,0 +1,85 @@
+#ifndef FLINCH_SCHEDULER_INCLUDE
+#define FLINCH_SCHEDULER_INCLUDE
+
+#include "flinch.hpp"
+#include "workpool.hpp"
+
+// runs many instances of one program over a fixed set of threads. each instance is its own ProgramState
+// (made on whichever thread picks it up) over the shared, read-only Program.
+// jobs go into the pool's queues; idle threads steal from busy ones.
+// with a slice budget, a job that makes more than that many jumps and calls is put back at the end of the queue
+// and continued later, so one long-running script can't hold up every job queued behind it
+struct Scheduler {
+    struct Job {
+        OutputSink sink;
+        InputSource source;
+        // called on the thread that ran the job, once it's done. error is empty if it ran to completion
+        std::function<void(const string & error)> done;
+        unique_ptr<ProgramState> state;
+        int ip = 0;
+    };
+
+    const Program & program;
+
+    std::mutex idle_m;
+    std::condition_variable idle_cv;
+    size_t pending = 0;
+    int64_t slice;
+
+    WorkPool pool; // last, so its threads are stopped before anything they use goes away
+
+    Scheduler(const Program & program, size_t threads = std::thread::hardware_concurrency(), int64_t slice = 0)
+        : program(program), slice(slice), pool(std::max((size_t)1, threads)) { }
+    ~Scheduler() { wait(); }
+
+    void submit(OutputSink sink, InputSource source = stdin_source(), std::function<void(const string &)> done = nullptr)
+    {
+        {
+            std::lock_guard<std::mutex> lock(idle_m);
+            pending++;
+        }
+        auto job = std::make_shared<Job>(Job{sink, source, std::move(done), nullptr});
+        pool.push([this, job]() { run(job); }, pool.home_queue());
+    }
+
+    // blocks until every submitted job has finished
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(idle_m);
+        idle_cv.wait(lock, [&]() { return pending == 0; });
+    }
+
+    void run(shared_ptr<Job> job)
+    {
+        string error;
+        try
+        {
+            if (!job->state) job->state = make_unique<ProgramState>(program, job->sink, job->source);
+            job->state->budget = slice > 0 ? slice : INT64_MAX;
+            job->ip = interpreter_core(*job->state, job->ip);
+            if (job->ip >= 0)
+            {
+                // the last queue is the shared one, which workers only take from the front of, so this goes behind everything else
+                pool.push([this, job]() { run(job); }, pool.size() - 1);
+                return;
+            }
+        }
+        catch (const exception & e) { error = e.what(); }
+
+        // the job counts as finished even if flushing its output or the done callback throws, or wait() would never return.
+        // nothing past this point can be reported to anyone, and letting it out would take down the pool's thread
+        try
+        {
+            if (job->state) job->state->out.flush();
+            job->state = nullptr;
+            if (job->done) job->done(error);
+        }
+        catch (...) { }
+        job->state = nullptr;
+
+        std::lock_guard<std::mutex> lock(idle_m);
+        if (--pending == 0) idle_cv.notify_all();
+    }
+};
+
+#endif // FLINCH_SCHEDULER_INCLUDE
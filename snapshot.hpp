@@ -0,0 +1,328 @@
+#ifndef FLINCH_SNAPSHOT_INCLUDE
+#define FLINCH_SNAPSHOT_INCLUDE
+
+#include "flinch.hpp"
+
+// a frozen copy of everything reachable from a ProgramState's globals, e.g. taken right after a program's top level
+// has built its lookup tables. new states get restored from it instead of rerunning that code.
+// arrays that only hold plain values (numbers, labels, functions) aren't copied on restore: the new state borrows
+// them copy-on-write, and only copies one the first time something writes to it.
+// snapshots are never written to after they're made, so one can be restored from on several threads at once
+struct Snapshot {
+    ArrayData globals;
+    unordered_set<const ArrayStore *> cowable;
+
+    static Snapshot take(ProgramState & s);
+    void restore(ProgramState & s) const;
+
+    // for cold starts. the file is only valid for the exact same program, built for the same kind of machine
+    void save(const Program & programdata, const string & filename) const;
+    static Snapshot load(const Program & programdata, const string & filename);
+};
+
+// copies a graph of arrays, refs and maps, keeping anything that was shared (or cyclic) in the original shared in the copy.
+// with a cowable set, those arrays are borrowed instead of copied
+struct SnapshotCopier {
+    const unordered_set<const ArrayStore *> * cowable = nullptr;
+    unordered_map<const ArrayStore *, ArrayData> datas;
+    unordered_map<PointerInfo *, Array> arrays;
+    unordered_map<MapData *, Map> maps;
+
+    // what Snapshot::take needs to know to decide what can be borrowed later
+    unordered_map<const ArrayStore *, size_t> handles;
+    unordered_set<const ArrayStore *> pinned;
+
+    ArrayData copy_data(const ArrayData & d)
+    {
+        auto it = datas.find(d.get());
+        if (it != datas.end()) return it->second;
+        if (cowable && cowable->count(d.get())) return datas[d.get()] = d;
+        auto n = make_array_data();
+        datas[d.get()] = n;
+        n->resize(d->size()); // sized up front so that refs into it stay valid while it's being filled
+        for (size_t i = 0; i < d->size(); i++) (*n)[i] = copy((*d)[i]);
+        return n;
+    }
+    DynamicType copy(DynamicType & v)
+    {
+        if (v.is_array())
+        {
+            auto p = v.as_array().info.p;
+            auto it = arrays.find(p);
+            if (it != arrays.end()) return it->second;
+            Array a = make_array(make_array_data());
+            arrays.insert({p, a});
+            a.info.p->items = copy_data(p->items);
+            a.info.p->cow = a.info.p->items == p->items;
+            handles[a.items().get()] += 1;
+            return a;
+        }
+        if (v.is_ref())
+        {
+            auto p = v.as_ref().info.p;
+            auto d = copy_data(p->items);
+            pinned.insert(d.get());
+            return make_ref_2(d, p->refdata - p->items->data());
+        }
+        if (v.is_map())
+        {
+            auto m = v.as_map().p;
+            auto it = maps.find(m);
+            if (it != maps.end()) return it->second;
+            Map n = make_map();
+            maps.insert({m, n});
+            n.p->keys = copy_data(m->keys);
+            n.p->values = copy_data(m->values);
+            n.p->slots = m->slots;
+            n.p->tombstones = m->tombstones;
+            pinned.insert(n.p->keys.get());
+            pinned.insert(n.p->values.get());
+            return n;
+        }
+        if (v.is_coro()) THROWSTR("Can't snapshot a coroutine");
+        return v;
+    }
+};
+
+// only arrays with exactly one handle can be borrowed, so that writes through one copy of an array are still seen by the others.
+// things that refs or maps point into are always copied, since those write to them without going through an Array
+bool snapshot_is_cowable(ArrayStore & d, size_t handles, bool pinned)
+{
+    if (handles != 1 || pinned) return false;
+    for (auto & x : d) { if (x.is_array() || x.is_ref() || x.is_map() || x.is_coro()) return false; }
+    return true;
+}
+
+Snapshot Snapshot::take(ProgramState & s)
+{
+    SnapshotCopier c;
+    Snapshot snap;
+    snap.globals = c.copy_data(s.globals);
+    for (auto & [_, d] : c.datas)
+    {
+        if (snapshot_is_cowable(*d, c.handles[d.get()], c.pinned.count(d.get()))) snap.cowable.insert(d.get());
+    }
+    return snap;
+}
+
+void Snapshot::restore(ProgramState & s) const
+{
+    if (globals->size() != s.globals->size()) THROWSTR("Snapshot is from a different program");
+    SnapshotCopier c;
+    c.cowable = &cowable;
+    s.globals = c.copy_data(globals);
+    s.globals_raw = s.globals->data();
+}
+
+uint64_t program_fingerprint(const Program & programdata)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    auto mix = [&](uint64_t x) { h = (h ^ x) * 0x100000001b3ULL; };
+    for (auto & t : programdata.program) { mix(t.kind); mix(t.n); mix(t.extra_1); mix(t.extra_2); }
+    mix(programdata.token_varnames.size());
+    return h;
+}
+
+// file layout: header, then every array's items, then every array handle (as an items index), then every map.
+// values refer to handles, items and maps by index
+void Snapshot::save(const Program & programdata, const string & filename) const
+{
+    vector<const ArrayStore *> datas;
+    vector<PointerInfo *> arrays;
+    vector<MapData *> maps;
+    unordered_map<const ArrayStore *, uint32_t> data_ids;
+    unordered_map<PointerInfo *, uint32_t> array_ids;
+    unordered_map<MapData *, uint32_t> map_ids;
+
+    auto add_data = [&](const ArrayStore * d) {
+        if (!data_ids.count(d)) { data_ids[d] = datas.size(); datas.push_back(d); }
+        return data_ids[d];
+    };
+    add_data(globals.get());
+    for (size_t i = 0; i < datas.size(); i++)
+    {
+        for (auto & x : *datas[i])
+        {
+            auto & v = const_cast<DynamicType &>(x);
+            if (v.is_array() && !array_ids.count(v.as_array().info.p))
+            {
+                array_ids[v.as_array().info.p] = arrays.size();
+                arrays.push_back(v.as_array().info.p);
+                add_data(v.as_array().info.p->items.get());
+            }
+            else if (v.is_ref()) add_data(v.as_ref().info.p->items.get());
+            else if (v.is_map() && !map_ids.count(v.as_map().p))
+            {
+                map_ids[v.as_map().p] = maps.size();
+                maps.push_back(v.as_map().p);
+                add_data(v.as_map().p->keys.get());
+                add_data(v.as_map().p->values.get());
+            }
+        }
+    }
+
+    string out;
+    auto put = [&](auto x) { out.append((const char *)&x, sizeof(x)); };
+    out.append("FLINCHSNAPSHOT01", 16);
+    put(program_fingerprint(programdata));
+    put((uint64_t)datas.size());
+    put((uint64_t)arrays.size());
+    put((uint64_t)maps.size());
+    for (auto d : datas)
+    {
+        put((uint64_t)d->size());
+        for (auto & x : *d)
+        {
+            auto & v = const_cast<DynamicType &>(x);
+            if (v.is_int()) { put((uint8_t)0); put(v.as_int()); }
+            else if (v.is_double()) { put((uint8_t)1); put(v.as_double()); }
+            else if (v.is_label()) { put((uint8_t)2); put((int64_t)v.as_label().loc); }
+            else if (v.is_func()) { put((uint8_t)3); put(v.as_func().loc); put(v.as_func().varcount); }
+            else if (v.is_array()) { put((uint8_t)4); put((uint64_t)array_ids[v.as_array().info.p]); }
+            else if (v.is_ref())
+            {
+                auto p = v.as_ref().info.p;
+                put((uint8_t)5);
+                put((uint64_t)data_ids[p->items.get()]);
+                put((uint64_t)(p->refdata - p->items->data()));
+            }
+            else if (v.is_map()) { put((uint8_t)6); put((uint64_t)map_ids[v.as_map().p]); }
+            else THROWSTR("Can't snapshot a coroutine");
+        }
+    }
+    for (auto p : arrays) put((uint64_t)data_ids[p->items.get()]);
+    for (auto m : maps)
+    {
+        put((uint64_t)data_ids[m->keys.get()]);
+        put((uint64_t)data_ids[m->values.get()]);
+        put((uint64_t)m->tombstones);
+        put((uint64_t)m->slots.size());
+        out.append((const char *)m->slots.data(), m->slots.size() * sizeof(uint32_t));
+    }
+
+    auto file = fopen(filename.data(), "wb");
+    if (!file) THROWSTR("Failed to open snapshot file " + filename + " for writing");
+    size_t written = fwrite(out.data(), 1, out.size(), file);
+    fclose(file);
+    if (written != out.size()) THROWSTR("Failed to write snapshot file " + filename);
+}
+
+Snapshot Snapshot::load(const Program & programdata, const string & filename)
+{
+    auto file = fopen(filename.data(), "rb");
+    if (!file) THROWSTR("Failed to open snapshot file " + filename);
+    string text;
+    char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), file))) text.append(buf, n);
+    fclose(file);
+
+    size_t pos = 0;
+    auto corrupt = [&]() { THROWSTR("Snapshot file " + filename + " is truncated or corrupt"); };
+    auto get = [&](auto & x) {
+        if (text.size() - pos < sizeof(x)) corrupt();
+        memcpy(&x, text.data() + pos, sizeof(x));
+        pos += sizeof(x);
+    };
+    auto get_u64 = [&]() { uint64_t x; get(x); return x; };
+    auto get_index = [&](size_t count) {
+        auto x = get_u64();
+        if (x >= count) corrupt();
+        return x;
+    };
+
+    if (text.compare(0, 16, "FLINCHSNAPSHOT01") != 0) THROWSTR(filename + " is not a snapshot file");
+    pos = 16;
+    if (get_u64() != program_fingerprint(programdata)) THROWSTR("Snapshot file " + filename + " is from a different program");
+
+    size_t data_count = get_u64();
+    size_t array_count = get_u64();
+    size_t map_count = get_u64();
+    if (!data_count || data_count > text.size() || array_count > text.size() || map_count > text.size()) corrupt();
+
+    // everything gets made first, so that values can point at things that come later in the file
+    Snapshot snap;
+    vector<ArrayData> datas;
+    vector<Array> arrays;
+    vector<Map> maps;
+    for (size_t i = 0; i < data_count; i++) datas.push_back(make_array_data());
+    for (size_t i = 0; i < array_count; i++) arrays.push_back(make_array(nullptr));
+    for (size_t i = 0; i < map_count; i++) maps.push_back(make_map());
+
+    vector<size_t> handles(data_count);
+    vector<bool> pinned(data_count);
+    struct PendingRef { DynamicType * slot; size_t target, offset; };
+    vector<PendingRef> refs;
+    
+    for (auto & d : datas)
+    {
+        auto len = get_u64();
+        if (len > text.size()) corrupt();
+        d->resize(len);
+        for (auto & x : *d)
+        {
+            uint8_t kind;
+            get(kind);
+            if (kind == 0) { int64_t v; get(v); x = v; }
+            else if (kind == 1) { double v; get(v); x = v; }
+            else if (kind == 2) { int64_t v; get(v); if ((uint64_t)v >= programdata.program.size()) corrupt(); x = Label{(int)v}; }
+            else if (kind == 3) { Func f; get(f.loc); get(f.varcount); if (f.loc >= programdata.program.size()) corrupt(); x = f; }
+            else if (kind == 4) x = arrays[get_index(array_count)];
+            else if (kind == 5)
+            {
+                // the target might not have been read in yet, so the ref gets made once everything has been
+                auto target = get_index(data_count);
+                refs.push_back({&x, target, get_u64()});
+                pinned[target] = true;
+            }
+            else if (kind == 6) x = maps[get_index(map_count)];
+            else corrupt();
+        }
+    }
+    for (auto & r : refs)
+    {
+        if (r.offset >= datas[r.target]->size()) corrupt();
+        *r.slot = make_ref_2(datas[r.target], r.offset);
+    }
+    for (auto & a : arrays)
+    {
+        auto d = get_index(data_count);
+        a.info.p->items = datas[d];
+        handles[d] += 1;
+    }
+    for (auto & m : maps)
+    {
+        auto k = get_index(data_count);
+        auto v = get_index(data_count);
+        pinned[k] = pinned[v] = true;
+        m.p->keys = datas[k];
+        m.p->values = datas[v];
+        m.p->tombstones = get_u64();
+        size_t slot_count = get_u64();
+        if (slot_count > (text.size() - pos) / sizeof(uint32_t)) corrupt();
+        m.p->slots.resize(slot_count);
+        memcpy(m.p->slots.data(), text.data() + pos, slot_count * sizeof(uint32_t));
+        pos += slot_count * sizeof(uint32_t);
+        
+        // probing relies on these, so a bad file could otherwise hang or read out of bounds
+        if (m.p->keys->size() != m.p->values->size() || (slot_count & (slot_count - 1))) corrupt();
+        if (slot_count && std::find(m.p->slots.begin(), m.p->slots.end(), 0) == m.p->slots.end()) corrupt();
+        for (auto x : m.p->slots) { if (x != MapData::tombstone && x > m.p->keys->size()) corrupt(); }
+    }
+    
+    for (size_t i = 0; i < data_count; i++)
+    {
+        if (snapshot_is_cowable(*datas[i], handles[i], pinned[i])) snap.cowable.insert(datas[i].get());
+    }
+    snap.globals = datas[0];
+    if (snap.globals->size() != programdata.token_varnames.size())
+        THROWSTR("Snapshot file " + filename + " is from a different program");
+    return snap;
+}
+
+VM::VM(const Program & programdata, const Snapshot & snap, OutputSink sink, InputSource source) : s(programdata, sink, source)
+{
+    snap.restore(s);
+}
+
+#endif // FLINCH_SNAPSHOT_INCLUDE
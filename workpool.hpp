@@ -0,0 +1,126 @@
+#ifndef FLINCH_WORKPOOL_INCLUDE
+#define FLINCH_WORKPOOL_INCLUDE
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <algorithm>
+
+// small work-stealing thread pool. every worker has its own queue, which it takes work from the back of;
+// when that runs dry, it steals from the front of the other queues. threads outside of the pool share one extra queue
+struct WorkPool {
+    struct Queue {
+        std::mutex m;
+        std::deque<std::function<void()>> tasks;
+    };
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+
+    std::mutex sleep_m;
+    std::condition_variable sleep_cv;
+    std::atomic<size_t> queued = 0;
+    bool stopping = false;
+
+    // which pool (if any) the current thread belongs to, and its queue there. a worker of one pool that uses another
+    // (e.g. a Scheduler job calling !parallel_for) is an outside thread as far as that other pool is concerned
+    static thread_local const WorkPool * worker_pool;
+    static thread_local int worker_id;
+
+    WorkPool(size_t count)
+    {
+        for (size_t i = 0; i < count + 1; i++) queues.push_back(std::make_unique<Queue>());
+        for (size_t i = 0; i < count; i++)
+            threads.emplace_back([this, i]() { worker_pool = this; worker_id = i; work(i); });
+    }
+    ~WorkPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleep_m);
+            stopping = true;
+        }
+        sleep_cv.notify_all();
+        for (auto & t : threads) t.join();
+    }
+
+    size_t home_queue() { return worker_pool == this ? worker_id : threads.size(); }
+    size_t size() { return queues.size(); }
+
+    void push(std::function<void()> f, size_t queue)
+    {
+        {
+            std::lock_guard<std::mutex> lock(queues[queue]->m);
+            queues[queue]->tasks.push_back(std::move(f));
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleep_m);
+            queued++;
+        }
+        sleep_cv.notify_one();
+    }
+    bool try_run_one(size_t home)
+    {
+        std::function<void()> f;
+        for (size_t n = 0; n < queues.size() && !f; n++)
+        {
+            auto & q = *queues[(home + n) % queues.size()];
+            std::lock_guard<std::mutex> lock(q.m);
+            if (!q.tasks.size()) continue;
+            if (n == 0) { f = std::move(q.tasks.back()); q.tasks.pop_back(); }
+            else { f = std::move(q.tasks.front()); q.tasks.pop_front(); }
+        }
+        if (!f) return false;
+        queued--;
+        f();
+        return true;
+    }
+    void work(size_t id)
+    {
+        while (1)
+        {
+            if (try_run_one(id)) continue;
+            std::unique_lock<std::mutex> lock(sleep_m);
+            sleep_cv.wait(lock, [&]() { return queued > 0 || stopping; });
+            if (stopping) return;
+        }
+    }
+
+    // runs all of the given tasks, spread over the pool's queues, and returns once they're done
+    // the calling thread helps out instead of just waiting. rethrows the first exception that any task threw
+    void run_all(std::vector<std::function<void()>> & tasks)
+    {
+        std::atomic<size_t> remaining = tasks.size();
+        std::mutex error_m;
+        std::exception_ptr error;
+        auto home = home_queue();
+        for (size_t i = 0; i < tasks.size(); i++)
+        {
+            push([&, i]() {
+                try { tasks[i](); }
+                catch (...) { std::lock_guard<std::mutex> lock(error_m); if (!error) error = std::current_exception(); }
+                remaining--;
+            }, (home + i) % queues.size());
+        }
+        while (remaining)
+        {
+            if (!try_run_one(home)) std::this_thread::yield();
+        }
+        if (error) std::rethrow_exception(error);
+    }
+};
+thread_local const WorkPool * WorkPool::worker_pool = nullptr;
+thread_local int WorkPool::worker_id = -1;
+
+// shared by everything in the process, made on first use
+WorkPool & default_workpool()
+{
+    static WorkPool pool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+    return pool;
+}
+
+#endif // FLINCH_WORKPOOL_INCLUDE